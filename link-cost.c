@@ -0,0 +1,274 @@
+/**
+ * \addtogroup rimelinkcost
+ * @{
+ */
+
+/*
+ * Copyright (c) 2014, University of Southern California.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file is part of the Contiki operating system.
+ *
+ */
+
+/**
+ * \file
+ *         Rime link cost estimation (ETX, RSSI, LQI)
+ * \author
+ *         {Jiahao Liang, Zhikun Liu, Haimo Bai} @ USC
+ */
+
+#include "contiki.h"
+#include "lib/list.h"
+#include "lib/memb.h"
+#include "net/rime.h"
+#include "net/rime/link-cost.h"
+
+/*---------------------------------------------------------------------------*/
+/*Parameters and constants*/
+#ifdef LINK_COST_CONF_ENTRIES
+#define NUM_LINK_ENTRIES LINK_COST_CONF_ENTRIES
+#else /* LINK_COST_CONF_ENTRIES */
+#define NUM_LINK_ENTRIES 8
+#endif /* LINK_COST_CONF_ENTRIES */
+/*
+ * The ETX is an exponentially weighted moving average of the
+ * transmissions each unicast packet took, as reported by the MAC layer to
+ * link_cost_sent(), or one for each acknowledged packet reported to
+ * link_cost_status(): the old value weighs ETX_ALPHA / ETX_SCALE. A packet
+ * that was never acknowledged counts as ETX_NOACK_PENALTY transmissions.
+ */
+#define ETX_SCALE 100
+#define ETX_ALPHA 90
+#define ETX_NOACK_PENALTY 10
+//ETX of a neighbor we know nothing about.
+#define ETX_UNKNOWN (2 * LINK_COST_ETX_DIVISOR)
+/*
+ * Until a unicast to a neighbor has completed, its ETX is guessed from
+ * the LQI of what we heard from it: LQI_GOOD and above means one
+ * transmission, every LQI_STEP below adds another one.
+ */
+#define LQI_GOOD 100
+#define LQI_STEP 16
+/*---------------------------------------------------------------------------*/
+
+#define DEBUG 0
+#if DEBUG
+#include <stdio.h>
+#define PRINTF(...) printf(__VA_ARGS__)
+#else
+#define PRINTF(...)
+#endif
+
+//Link estimate for one neighbor.
+struct link_entry {
+	struct link_entry *next;
+	rimeaddr_t addr;
+	uint16_t etx;	//in 1 / LINK_COST_ETX_DIVISOR transmissions
+	int16_t rssi;	//of the last packet heard from the neighbor
+	uint8_t lqi;	//of the last packet heard from the neighbor
+	uint8_t measured:1;	//etx comes from transmissions, not from the LQI guess
+	uint8_t padding:7;	//not used, initialized to 0;
+};
+
+/*
+ * List of link estimates, most recently updated first. When it is full
+ * the entry at the tail is reused.
+ */
+LIST(link_set);
+MEMB(link_set_mem, struct link_entry, NUM_LINK_ENTRIES);
+
+static void packet_heard(void);
+/* The sniffer is not told how many transmissions a packet took, so it
+   only listens. */
+RIME_SNIFFER(link_cost_sniffer, packet_heard, NULL);
+
+static uint8_t initialized;
+/*---------------------------------------------------------------------------*/
+static struct link_entry *
+link_lookup(const rimeaddr_t *addr)
+{
+	struct link_entry *e;
+
+	for(e = list_head(link_set); e != NULL; e = list_item_next(e)) {
+		if(rimeaddr_cmp(&e->addr, addr)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+/*---------------------------------------------------------------------------*/
+//Returns the entry of addr moved to the head of link_set, creating it if
+//needed.
+static struct link_entry *
+link_touch(const rimeaddr_t *addr)
+{
+	struct link_entry *e;
+
+	e = link_lookup(addr);
+	if(e != NULL) {
+		list_remove(link_set, e);
+	} else {
+		e = memb_alloc(&link_set_mem);
+		if(e == NULL) {
+			e = list_chop(link_set);
+		}
+		rimeaddr_copy(&e->addr, addr);
+		e->etx = ETX_UNKNOWN;
+		e->rssi = 0;
+		e->lqi = 0;
+		e->measured = 0;
+		e->padding = 0;
+	}
+	list_push(link_set, e);
+	return e;
+}
+/*---------------------------------------------------------------------------*/
+static uint16_t
+etx_from_lqi(uint8_t lqi)
+{
+	if(lqi >= LQI_GOOD) {
+		return LINK_COST_ETX_DIVISOR;
+	}
+	if(LQI_GOOD - lqi >= (ETX_NOACK_PENALTY - 1) * LQI_STEP) {
+		return ETX_NOACK_PENALTY * LINK_COST_ETX_DIVISOR;
+	}
+	return LINK_COST_ETX_DIVISOR +
+		((uint16_t)(LQI_GOOD - lqi) * LINK_COST_ETX_DIVISOR) / LQI_STEP;
+}
+/*---------------------------------------------------------------------------*/
+static void
+packet_heard(void)
+{
+	const rimeaddr_t *sender = packetbuf_addr(PACKETBUF_ADDR_SENDER);
+	struct link_entry *e;
+
+	if(rimeaddr_cmp(sender, &rimeaddr_null)) {
+		return;
+	}
+	e = link_touch(sender);
+	e->rssi = packetbuf_attr(PACKETBUF_ATTR_RSSI);
+	e->lqi = packetbuf_attr(PACKETBUF_ATTR_LINK_QUALITY);
+	if(!e->measured && e->lqi != 0) {
+		e->etx = etx_from_lqi(e->lqi);
+	}
+}
+/*---------------------------------------------------------------------------*/
+//Updates the ETX of the link to receiver with a unicast packet that the MAC
+//layer sent num_tx times, ending with mac_status. Called from the sent
+//callbacks of unicast connections, which are told num_tx.
+void
+link_cost_sent(const rimeaddr_t *receiver, int mac_status, int num_tx)
+{
+	struct link_entry *e;
+	uint16_t sample;
+
+	/* Broadcasts are not acknowledged and tell nothing about a link. */
+	if(rimeaddr_cmp(receiver, &rimeaddr_null)) {
+		return;
+	}
+	switch(mac_status) {
+	case MAC_TX_OK:
+		if(num_tx < 1) {
+			num_tx = 1;
+		} else if(num_tx > ETX_NOACK_PENALTY) {
+			num_tx = ETX_NOACK_PENALTY;
+		}
+		sample = num_tx * LINK_COST_ETX_DIVISOR;
+		break;
+	case MAC_TX_NOACK:
+		sample = ETX_NOACK_PENALTY * LINK_COST_ETX_DIVISOR;
+		break;
+	default:
+		/* Collisions and deferred packets are not the link's fault. */
+		return;
+	}
+
+	e = link_touch(receiver);
+	if(!e->measured) {
+		e->etx = sample;
+		e->measured = 1;
+	} else {
+		e->etx = ((uint32_t)e->etx * ETX_ALPHA +
+			(uint32_t)sample * (ETX_SCALE - ETX_ALPHA)) / ETX_SCALE;
+	}
+	PRINTF("link_cost: %d.%d status %d tx %d etx %d/%d\n",
+		receiver->u8[0], receiver->u8[1], mac_status, num_tx,
+		e->etx, LINK_COST_ETX_DIVISOR);
+}
+/*---------------------------------------------------------------------------*/
+//Updates the ETX of the link to receiver with a unicast packet that ended
+//with mac_status, counting one transmission when it was acknowledged. For
+//senders that only see the MAC status, such as rime sniffers.
+void
+link_cost_status(const rimeaddr_t *receiver, int mac_status)
+{
+	link_cost_sent(receiver, mac_status, 1);
+}
+/*---------------------------------------------------------------------------*/
+//Starts estimating link costs. Calling it again has no effect.
+void
+link_cost_init(void)
+{
+	if(initialized) {
+		return;
+	}
+	list_init(link_set);
+	memb_init(&link_set_mem);
+	rime_sniffer_add(&link_cost_sniffer);
+	initialized = 1;
+}
+/*---------------------------------------------------------------------------*/
+//Returns the ETX of the link to neighbor, in 1 / LINK_COST_ETX_DIVISOR
+//transmissions.
+uint16_t
+link_cost_etx(const rimeaddr_t *neighbor)
+{
+	struct link_entry *e = link_lookup(neighbor);
+
+	return e != NULL ? e->etx : ETX_UNKNOWN;
+}
+/*---------------------------------------------------------------------------*/
+//Returns the RSSI of the last packet heard from neighbor, 0 if none.
+int16_t
+link_cost_rssi(const rimeaddr_t *neighbor)
+{
+	struct link_entry *e = link_lookup(neighbor);
+
+	return e != NULL ? e->rssi : 0;
+}
+/*---------------------------------------------------------------------------*/
+//Returns the LQI of the last packet heard from neighbor, 0 if none.
+uint8_t
+link_cost_lqi(const rimeaddr_t *neighbor)
+{
+	struct link_entry *e = link_lookup(neighbor);
+
+	return e != NULL ? e->lqi : 0;
+}
+/*---------------------------------------------------------------------------*/
+/** @} */
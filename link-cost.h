@@ -0,0 +1,70 @@
+/**
+ * \addtogroup rime
+ * @{
+ */
+/**
+ * \defgroup rimelinkcost Rime link cost estimation
+ * @{
+ *
+ * The link-cost module keeps a per-neighbor estimate of the expected
+ * number of transmissions (ETX) of a packet, from the outcome of our own
+ * unicast transmissions and the RSSI/LQI of the packets we hear.
+ */
+
+/*
+ * Copyright (c) 2014, University of Southern California.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file is part of the Contiki operating system.
+ *
+ */
+
+/**
+ * \file
+ *         Header file for the Rime link cost estimation
+ * \author
+ *         {Jiahao Liang, Zhikun Liu, Haimo Bai} @ USC
+ */
+
+#ifndef __LINK_COST_H__
+#define __LINK_COST_H__
+
+#include "net/rime/rimeaddr.h"
+
+//ETX values are fixed point, LINK_COST_ETX_DIVISOR means one transmission.
+#define LINK_COST_ETX_DIVISOR 8
+
+void link_cost_init(void);
+void link_cost_sent(const rimeaddr_t *receiver, int mac_status, int num_tx);
+void link_cost_status(const rimeaddr_t *receiver, int mac_status);
+uint16_t link_cost_etx(const rimeaddr_t *neighbor);
+int16_t link_cost_rssi(const rimeaddr_t *neighbor);
+uint8_t link_cost_lqi(const rimeaddr_t *neighbor);
+
+#endif /* __LINK_COST_H__ */
+/** @} */
+/** @} */
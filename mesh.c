@@ -43,14 +43,50 @@
  */
 
 #include "contiki.h"
+#include "lib/list.h"
+#include "lib/memb.h"
 #include "net/rime.h"
 #include "net/rime/route.h"
+#include "net/rime/link-cost.h"
 #include "net/rime/mesh.h"
 
 #include <stddef.h> /* For offsetof */
 
 #define PACKET_TIMEOUT (CLOCK_SECOND * 10)
 
+/*
+ * Number of packets, over all connections and destinations, that can
+ * wait for a route discovery to complete.
+ */
+#ifdef MESH_CONF_QUEUED_PACKETS
+#define NUM_QUEUED_PACKETS MESH_CONF_QUEUED_PACKETS
+#else /* MESH_CONF_QUEUED_PACKETS */
+#define NUM_QUEUED_PACKETS 4
+#endif /* MESH_CONF_QUEUED_PACKETS */
+
+/* Number of mesh connections watched for link failures. */
+#ifdef MESH_CONF_CONNS
+#define NUM_MESH_CONNS MESH_CONF_CONNS
+#else /* MESH_CONF_CONNS */
+#define NUM_MESH_CONNS 2
+#endif /* MESH_CONF_CONNS */
+#define NUM_LINK_FAILURES 2	//failures waiting to be handled at once
+
+/*
+ * Local repair. The last packet handed to each next hop is kept until the
+ * next one, so that when its transmission fails it can wait for a small
+ * discovery, REPAIR_EXTRA_HOPS beyond the hop count of the broken route,
+ * instead of being dropped. The repair waits REPAIR_HOP_TIMEOUT for each
+ * hop it may reach, and a RERR is only sent if it fails.
+ */
+#ifdef MESH_CONF_LOCAL_REPAIR
+#define LOCAL_REPAIR MESH_CONF_LOCAL_REPAIR
+#else /* MESH_CONF_LOCAL_REPAIR */
+#define LOCAL_REPAIR 1
+#endif /* MESH_CONF_LOCAL_REPAIR */
+#define REPAIR_EXTRA_HOPS 2
+#define REPAIR_HOP_TIMEOUT (CLOCK_SECOND / 2)
+
 #define DEBUG 1
 #if DEBUG
 #include <stdio.h>
@@ -59,6 +95,164 @@
 #define PRINTF(...)
 #endif
 
+/*
+ * Packets waiting for a route, in arrival order. This replaces the single
+ * queued_data buffer of struct mesh_conn, which is left unused.
+ */
+struct queued_packet {
+  struct queued_packet *next;
+  struct mesh_conn *c;
+  rimeaddr_t source;
+  rimeaddr_t dest;
+  struct queuebuf *buf;
+  struct ctimer t;
+};
+
+LIST(queued_packets);
+MEMB(queued_packets_mem, struct queued_packet, NUM_QUEUED_PACKETS);
+static uint8_t num_queued;
+
+/*
+ * Open connections, by the channel of their multihop connection, so that
+ * a failed transmission seen by the sniffer can be traced back to them.
+ */
+static struct {
+  struct mesh_conn *c;
+  uint16_t channel;
+} conns[NUM_MESH_CONNS];
+static uint8_t num_conns;
+
+/*
+ * A data packet the next hop never acknowledged. The sniffer runs inside
+ * the MAC callback, so the route error is handled from a timer.
+ */
+struct link_failure {
+  struct link_failure *next;
+  struct mesh_conn *c;
+  rimeaddr_t source;
+  rimeaddr_t dest;
+  rimeaddr_t nexthop;
+  struct ctimer t;
+};
+
+LIST(link_failures);
+MEMB(link_failures_mem, struct link_failure, NUM_LINK_FAILURES);
+
+static void packet_sent(int mac_status);
+RIME_SNIFFER(mesh_sniffer, NULL, packet_sent);
+
+#if LOCAL_REPAIR
+//The last packet forwarded, see LOCAL_REPAIR.
+static struct {
+  struct mesh_conn *c;
+  struct queuebuf *buf;
+  rimeaddr_t source;
+  rimeaddr_t dest;
+  rimeaddr_t nexthop;
+} inflight;
+#endif /* LOCAL_REPAIR */
+
+/*---------------------------------------------------------------------------*/
+static void
+queued_packet_remove(struct queued_packet *q)
+{
+  ctimer_stop(&q->t);
+  list_remove(queued_packets, q);
+  queuebuf_free(q->buf);
+  memb_free(&queued_packets_mem, q);
+  num_queued--;
+}
+/*---------------------------------------------------------------------------*/
+//Drops a queued packet that found no route, telling its source if it is
+//not us.
+static void
+queued_packet_drop(struct queued_packet *q)
+{
+  PRINTF("queued_packet_drop: dropping packet from %d.%d to %d.%d\n",
+	 q->source.u8[0], q->source.u8[1], q->dest.u8[0], q->dest.u8[1]);
+  if(!rimeaddr_cmp(&q->source, &rimeaddr_node_addr)) {
+    route_discovery_rerr(&q->c->route_discovery_conn, RERR_NO_AVAILABLE_LINK,
+			 &q->source, &q->dest);
+  }
+  queued_packet_remove(q);
+}
+/*---------------------------------------------------------------------------*/
+static void
+queued_packet_timeout(void *ptr)
+{
+  queued_packet_drop(ptr);
+}
+/*---------------------------------------------------------------------------*/
+//Queues buf, a packet from source, until a route to dest is found. Returns
+//0 if there is no room for it; buf is then left to the caller.
+static int
+queued_packet_insert(struct mesh_conn *c, struct queuebuf *buf,
+		     const rimeaddr_t *source, const rimeaddr_t *dest)
+{
+  struct queued_packet *q;
+
+  q = memb_alloc(&queued_packets_mem);
+  if(q == NULL) {
+    return 0;
+  }
+  q->buf = buf;
+  q->c = c;
+  rimeaddr_copy(&q->source, source);
+  rimeaddr_copy(&q->dest, dest);
+  list_add(queued_packets, q);
+  num_queued++;
+  ctimer_set(&q->t, PACKET_TIMEOUT, queued_packet_timeout, q);
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+//Queues the packet in packetbuf until a route to dest is found. Returns 0
+//if there is no room for it.
+static int
+queued_packet_add(struct mesh_conn *c, const rimeaddr_t *dest)
+{
+  struct queuebuf *buf;
+
+  buf = queuebuf_new_from_packetbuf();
+  if(buf == NULL) {
+    return 0;
+  }
+  if(!queued_packet_insert(c, buf, packetbuf_addr(PACKETBUF_ADDR_ESENDER), dest)) {
+    queuebuf_free(buf);
+    return 0;
+  }
+  return 1;
+}
+#if LOCAL_REPAIR
+/*---------------------------------------------------------------------------*/
+static void
+inflight_free(void)
+{
+  if(inflight.buf != NULL) {
+    queuebuf_free(inflight.buf);
+    inflight.buf = NULL;
+  }
+}
+/*---------------------------------------------------------------------------*/
+//Keeps a copy of the packet in packetbuf, about to be sent to nexthop, until
+//the MAC layer reports on it. The copy is only worth its queuebuf if the
+//packet can be queued for a repair.
+static void
+inflight_keep(struct mesh_conn *c, const rimeaddr_t *dest, const rimeaddr_t *nexthop)
+{
+  inflight_free();
+  if(num_queued >= NUM_QUEUED_PACKETS) {
+    return;
+  }
+  inflight.buf = queuebuf_new_from_packetbuf();
+  if(inflight.buf == NULL) {
+    return;
+  }
+  inflight.c = c;
+  rimeaddr_copy(&inflight.source, packetbuf_addr(PACKETBUF_ADDR_ESENDER));
+  rimeaddr_copy(&inflight.dest, dest);
+  rimeaddr_copy(&inflight.nexthop, nexthop);
+}
+#endif /* LOCAL_REPAIR */
 /*---------------------------------------------------------------------------*/
 static void
 data_packet_received(struct multihop_conn *multihop,
@@ -91,22 +285,43 @@ data_packet_forward(struct multihop_conn *multihop,
   struct mesh_conn *c = (struct mesh_conn *)
     ((char *)multihop - offsetof(struct mesh_conn, multihop));
 
-  rt = route_lookup(dest);
+  rt = route_lookup_balanced(dest);
   if(rt == NULL) {
-    if(c->queued_data != NULL) {
-      queuebuf_free(c->queued_data);
+    if(route_discovery_unreachable(dest)) {
+      PRINTF("data_packet_forward: %d.%d unreachable, dropping data\n",
+	     dest->u8[0], dest->u8[1]);
+      if(!rimeaddr_cmp(originator, &rimeaddr_node_addr)) {
+	route_discovery_rerr(&c->route_discovery_conn, RERR_NO_AVAILABLE_LINK,
+			     originator, dest);
+      }
+      return NULL;
+    }
+    if(!queued_packet_add(c, dest)) {
+      PRINTF("data_packet_forward: queue full, dropping data to %d.%d\n",
+	     dest->u8[0], dest->u8[1]);
+      return NULL;
     }
 
     PRINTF("data_packet_forward: queueing data, sending rreq\n");
-    c->queued_data = queuebuf_new_from_packetbuf();
-    rimeaddr_copy(&c->queued_data_dest, dest);
-    route_discovery_discover(&c->route_discovery_conn, dest, PACKET_TIMEOUT);
+    if(!route_discovery_discover(&c->route_discovery_conn, dest, PACKET_TIMEOUT)) {
+      /* No discovery will answer for it, do not let it wait in vain. */
+      PRINTF("data_packet_forward: no discovery of %d.%d, dropping data\n",
+	     dest->u8[0], dest->u8[1]);
+      queued_packet_drop(list_tail(queued_packets));
+      if(c->cb->timedout) {
+        c->cb->timedout(c);
+      }
+    }
 
     return NULL;
   } else {
 	  /*The following line is commented because LOADng does not specify
 	  refreshing routes upon forwarding (only upon receiving)*/
 //    route_refresh(rt);
+    route_use(rt);
+#if LOCAL_REPAIR
+    inflight_keep(c, dest, &rt->R_next_addr);
+#endif /* LOCAL_REPAIR */
   }
   
   return &rt->R_next_addr;
@@ -116,19 +331,27 @@ static void
 found_route(struct route_discovery_conn *rdc, const rimeaddr_t *dest)
 {
   struct route_entry *rt;
+  struct queued_packet *q, *next;
   struct mesh_conn *c = (struct mesh_conn *)
     ((char *)rdc - offsetof(struct mesh_conn, route_discovery_conn));
 
   PRINTF("found_route\n");
 
-  if(c->queued_data != NULL &&
-     rimeaddr_cmp(dest, &c->queued_data_dest)) {
-    queuebuf_to_packetbuf(c->queued_data);
-    queuebuf_free(c->queued_data);
-    c->queued_data = NULL;
+  /* Send everything that waited for this destination, oldest first. */
+  for(q = list_head(queued_packets); q != NULL; q = next) {
+    next = list_item_next(q);
+    if(q->c != c || !rimeaddr_cmp(dest, &q->dest)) {
+      continue;
+    }
+    queuebuf_to_packetbuf(q->buf);
+    queued_packet_remove(q);
 
-    rt = route_lookup(dest);
+    rt = route_lookup_balanced(dest);
     if(rt != NULL) {
+      route_use(rt);
+#if LOCAL_REPAIR
+      inflight_keep(c, dest, &rt->R_next_addr);
+#endif /* LOCAL_REPAIR */
       multihop_resend(&c->multihop, &rt->R_next_addr);
       if(c->cb->sent != NULL) {
         c->cb->sent(c);
@@ -142,14 +365,17 @@ found_route(struct route_discovery_conn *rdc, const rimeaddr_t *dest)
 }
 /*---------------------------------------------------------------------------*/
 static void
-route_timed_out(struct route_discovery_conn *rdc)
+route_timed_out(struct route_discovery_conn *rdc, const rimeaddr_t *dest)
 {
+  struct queued_packet *q, *next;
   struct mesh_conn *c = (struct mesh_conn *)
     ((char *)rdc - offsetof(struct mesh_conn, route_discovery_conn));
 
-  if(c->queued_data != NULL) {
-    queuebuf_free(c->queued_data);
-    c->queued_data = NULL;
+  for(q = list_head(queued_packets); q != NULL; q = next) {
+    next = list_item_next(q);
+    if(q->c == c && rimeaddr_cmp(dest, &q->dest)) {
+      queued_packet_drop(q);
+    }
   }
 
   if(c->cb->timedout) {
@@ -157,29 +383,182 @@ route_timed_out(struct route_discovery_conn *rdc)
   }
 }
 /*---------------------------------------------------------------------------*/
+static void
+link_failure_remove(struct link_failure *f)
+{
+  ctimer_stop(&f->t);
+  list_remove(link_failures, f);
+  memb_free(&link_failures_mem, f);
+}
+/*---------------------------------------------------------------------------*/
+//Drops the broken route, then repairs it locally if the packet is still at
+//hand, or reports it to the source of the packet.
+static void
+link_failure_handle(void *ptr)
+{
+  struct link_failure *f = ptr;
+  struct route_entry *rt;
+#if LOCAL_REPAIR
+  uint8_t hops;
+  clock_time_t timeout;
+#endif /* LOCAL_REPAIR */
+
+  PRINTF("link_failure_handle: %d.%d did not ack packet from %d.%d to %d.%d\n",
+	 f->nexthop.u8[0], f->nexthop.u8[1],
+	 f->source.u8[0], f->source.u8[1],
+	 f->dest.u8[0], f->dest.u8[1]);
+
+  rt = route_lookup_via(&f->dest, &f->nexthop);
+#if LOCAL_REPAIR
+  hops = rt != NULL ? rt->R_dist.hops : 1;
+  hops = hops > 255 - REPAIR_EXTRA_HOPS ? 255 : hops + REPAIR_EXTRA_HOPS;
+  /* A repair outliving the packet it is for would be of no use. */
+  timeout = hops * REPAIR_HOP_TIMEOUT;
+  if(timeout > PACKET_TIMEOUT) {
+    timeout = PACKET_TIMEOUT;
+  }
+#endif /* LOCAL_REPAIR */
+  route_remove(rt);
+
+#if LOCAL_REPAIR
+  if(inflight.buf != NULL && inflight.c == f->c &&
+     rimeaddr_cmp(&inflight.dest, &f->dest) &&
+     rimeaddr_cmp(&inflight.nexthop, &f->nexthop) &&
+     queued_packet_insert(f->c, inflight.buf, &inflight.source, &f->dest)) {
+    inflight.buf = NULL;
+    if(route_lookup(&f->dest) != NULL) {
+      /* Another alternate is still there, use it right away. */
+      found_route(&f->c->route_discovery_conn, &f->dest);
+    } else if(!route_discovery_repairs(&f->c->route_discovery_conn, &f->dest,
+				       timeout, hops)) {
+      /* No repair will answer for it, report the broken route at once. */
+      queued_packet_drop(list_tail(queued_packets));
+    }
+    link_failure_remove(f);
+    return;
+  }
+#endif /* LOCAL_REPAIR */
+
+  if(!rimeaddr_cmp(&f->source, &rimeaddr_node_addr)) {
+    route_discovery_rerr(&f->c->route_discovery_conn, RERR_NO_AVAILABLE_LINK,
+			 &f->source, &f->dest);
+  }
+  link_failure_remove(f);
+}
+/*---------------------------------------------------------------------------*/
+static void
+packet_sent(int mac_status)
+{
+  struct link_failure *f;
+  uint16_t channel;
+  uint8_t i;
+
+  channel = packetbuf_attr(PACKETBUF_ATTR_CHANNEL);
+  for(i = 0; i < NUM_MESH_CONNS; i++) {
+    if(conns[i].c != NULL && conns[i].channel == channel) {
+      break;
+    }
+  }
+  if(i == NUM_MESH_CONNS) {
+    return;
+  }
+  /* multihop does not report num_tx, the status alone feeds the ETX. */
+  link_cost_status(packetbuf_addr(PACKETBUF_ADDR_RECEIVER), mac_status);
+
+#if LOCAL_REPAIR
+  if(mac_status != MAC_TX_NOACK) {
+    /* Delivered, or lost to something a repair cannot fix. */
+    if(inflight.buf != NULL &&
+       rimeaddr_cmp(&inflight.dest, packetbuf_addr(PACKETBUF_ADDR_ERECEIVER)) &&
+       rimeaddr_cmp(&inflight.nexthop, packetbuf_addr(PACKETBUF_ADDR_RECEIVER))) {
+      inflight_free();
+    }
+    return;
+  }
+#else /* LOCAL_REPAIR */
+  if(mac_status != MAC_TX_NOACK) {
+    return;
+  }
+#endif /* LOCAL_REPAIR */
+
+  f = memb_alloc(&link_failures_mem);
+  if(f == NULL) {
+    return;
+  }
+  f->c = conns[i].c;
+  rimeaddr_copy(&f->source, packetbuf_addr(PACKETBUF_ADDR_ESENDER));
+  rimeaddr_copy(&f->dest, packetbuf_addr(PACKETBUF_ADDR_ERECEIVER));
+  rimeaddr_copy(&f->nexthop, packetbuf_addr(PACKETBUF_ADDR_RECEIVER));
+  list_add(link_failures, f);
+  ctimer_set(&f->t, 0, link_failure_handle, f);
+}
+/*---------------------------------------------------------------------------*/
 static const struct multihop_callbacks data_callbacks = { data_packet_received,
 						    data_packet_forward };
 static const struct route_discovery_callbacks route_discovery_callbacks =
-  { found_route, route_timed_out };
+  { found_route, NULL, route_timed_out };
 /*---------------------------------------------------------------------------*/
 void
 mesh_open(struct mesh_conn *c, uint16_t channels,
 	  const struct mesh_callbacks *callbacks)
 {
+  uint8_t i;
+
   route_init();
+  c->queued_data = NULL;
   multihop_open(&c->multihop, channels, &data_callbacks);
   route_discovery_open(&c->route_discovery_conn,
 		       CLOCK_SECOND * 2,
 		       channels + 1,
 		       &route_discovery_callbacks);
   c->cb = callbacks;
+
+  for(i = 0; i < NUM_MESH_CONNS; i++) {
+    if(conns[i].c == NULL) {
+      conns[i].c = c;
+      conns[i].channel = channels;
+      if(num_conns++ == 0) {
+	rime_sniffer_add(&mesh_sniffer);
+      }
+      break;
+    }
+  }
 }
 /*---------------------------------------------------------------------------*/
 void
 mesh_close(struct mesh_conn *c)
 {
+  struct queued_packet *q, *next;
+  struct link_failure *f, *next_f;
+  uint8_t i;
+
   multihop_close(&c->multihop);
   route_discovery_close(&c->route_discovery_conn);
+  for(q = list_head(queued_packets); q != NULL; q = next) {
+    next = list_item_next(q);
+    if(q->c == c) {
+      queued_packet_remove(q);
+    }
+  }
+  for(f = list_head(link_failures); f != NULL; f = next_f) {
+    next_f = list_item_next(f);
+    if(f->c == c) {
+      link_failure_remove(f);
+    }
+  }
+#if LOCAL_REPAIR
+  if(inflight.c == c) {
+    inflight_free();
+  }
+#endif /* LOCAL_REPAIR */
+  for(i = 0; i < NUM_MESH_CONNS; i++) {
+    if(conns[i].c == c) {
+      conns[i].c = NULL;
+      if(--num_conns == 0) {
+	rime_sniffer_remove(&mesh_sniffer);
+      }
+    }
+  }
 }
 /*---------------------------------------------------------------------------*/
 int
@@ -206,7 +585,7 @@ mesh_send(struct mesh_conn *c, const rimeaddr_t *to)
 int
 mesh_ready(struct mesh_conn *c)
 {
-  return (c->queued_data == NULL);
+  return (num_queued < NUM_QUEUED_PACKETS);
 }
 
 
@@ -43,12 +43,18 @@
  */
 
 #include "contiki.h"
+#include "lib/list.h"
+#include "lib/memb.h"
+#include "lib/random.h"
 #include "net/rime.h"
+#include "net/rime/link-cost.h"
 #include "net/rime/route.h"
+#include "net/rime/route-metric.h"
 #include "net/rime/route-discovery.h"
 
 #include <stddef.h> /* For offsetof */
 #include <stdio.h>
+#include <string.h>
 
 //This structure stores the <message> field of a RREQ and RREPpacket
 //RREQ-Specific and RREP Message
@@ -56,23 +62,32 @@ typedef struct general_message{
 	//uint8_t addr-length:4;
 	uint8_t type;
 	uint8_t seqno;
-	/*if metric_type set to 0 hop_count is used otherwise route_metric is used*/
+	/*one of the ROUTE_METRIC_* of route-metric.h, route_metric is expressed in it*/
 	uint8_t metric_type;
 	uint32_t route_metric;
 	uint8_t hop_limit;
 	uint8_t hop_count;
+	uint8_t weak_links;	//weak links along the path, see ROUTE_METRIC_WEAK_LINK()
 	rimeaddr_t originator;
 	rimeaddr_t destination;
 	//TODO:only used for RREP
 	uint8_t ackrequired;
 }rreq_message,rrep_message;
 
+//A RREQ looking for several destinations at once. The destination field of
+//hdr is unused, the destinations are listed in targets.
+struct rreq_multi_message {
+	rreq_message hdr;
+	uint8_t num_targets;
+	rimeaddr_t targets[ROUTE_DISCOVERY_MAX_TARGETS];
+};
+
 //This structure stores the <message> field of a RREP-ACK packet.
 typedef struct rrep_ack_message_struture {
 	//uint8_t addr-length:4;
 	uint8_t type;
-	uint8_t seqno;
-	rimeaddr_t destination;
+	uint8_t seqno;	//seqno of the acknowledged RREP
+	rimeaddr_t destination;	//originator of the acknowledged RREP
 }rrep_ack_message;
 
 typedef struct rerr_message_struture {
@@ -102,18 +117,152 @@ typedef struct rerr_message_struture {
 /*------------------------------------------------------------------------------------------------------------------------*/
 /*Parameters and constants*/
 #define ROUTE_TIMEOUT 5
-#define RREP_ACK_TIMEOUT 0.1
-#define ROUTE_DISCOVERY_ENTRIES 8
+/*
+ * Number of times a RREQ is re-sent before a discovery is declared
+ * failed. Each attempt waits twice as long as the previous one.
+ */
+#ifdef ROUTE_DISCOVERY_CONF_MAX_RETRIES
+#define MAX_RETRIES ROUTE_DISCOVERY_CONF_MAX_RETRIES
+#else /* ROUTE_DISCOVERY_CONF_MAX_RETRIES */
 #define MAX_RETRIES 3
-#define MAX_REPAIR_RETRIES max_retries
-#define NUM_REQ_ENTRIES 8
+#endif /* ROUTE_DISCOVERY_CONF_MAX_RETRIES */
+#define NUM_REQ_ENTRIES 8	//RREQs that can wait for their forwarding jitter at once
+/*
+ * Forwarded RREQs are delayed by a random jitter so that neighbors
+ * hearing the same RREQ do not rebroadcast it at the same instant.
+ * JITTER selects the distribution (0 forwards at once), MEAN_BACKOFF
+ * is its mean in milliseconds.
+ */
+#define UNIFORM 1	//uniform over [0, 2 * MEAN_BACKOFF]
+#define EXPONENTIAL 2	//exponential with mean MEAN_BACKOFF, cut at 8 * MEAN_BACKOFF
+#ifdef ROUTE_DISCOVERY_CONF_JITTER
+#define JITTER ROUTE_DISCOVERY_CONF_JITTER
+#else /* ROUTE_DISCOVERY_CONF_JITTER */
+#define JITTER UNIFORM
+#endif /* ROUTE_DISCOVERY_CONF_JITTER */
+#ifdef ROUTE_DISCOVERY_CONF_MEAN_BACKOFF
+#define MEAN_BACKOFF ROUTE_DISCOVERY_CONF_MEAN_BACKOFF
+#else /* ROUTE_DISCOVERY_CONF_MEAN_BACKOFF */
 #define MEAN_BACKOFF 50
-#define UNIFORM 1
-#define EXPONENTIAL 1-uniform
+#endif /* ROUTE_DISCOVERY_CONF_MEAN_BACKOFF */
+#if JITTER == EXPONENTIAL
+#define MAX_JITTER ((8UL * MEAN_BACKOFF * CLOCK_SECOND) / 1000)
+#elif JITTER
+#define MAX_JITTER ((2UL * MEAN_BACKOFF * CLOCK_SECOND) / 1000)
+#else /* JITTER */
+#define MAX_JITTER 0
+#endif /* JITTER */
+/*
+ * HOP_TIME is how long one unicast hop may take under radio duty cycling:
+ * the receiver only wakes up once every channel check interval.
+ */
+#ifdef NETSTACK_CONF_RDC_CHANNEL_CHECK_RATE
+#define CHANNEL_CHECK_RATE NETSTACK_CONF_RDC_CHANNEL_CHECK_RATE
+#else /* NETSTACK_CONF_RDC_CHANNEL_CHECK_RATE */
+#define CHANNEL_CHECK_RATE 8
+#endif /* NETSTACK_CONF_RDC_CHANNEL_CHECK_RATE */
+#define HOP_TIME ((clock_time_t)(CLOCK_SECOND / CHANNEL_CHECK_RATE))
+/*
+ * A RREP sent with ACK-REQUIRED is retransmitted every RREP_ACK_TIMEOUT
+ * until the next hop acknowledges it, at most RREP_MAX_RETRIES times.
+ * The next hop sends the RREP-ACK after forwarding the RREP, so the ACK
+ * waits for three hops: ours, the forwarded RREP and its own.
+ */
+#ifdef ROUTE_DISCOVERY_CONF_RREP_ACK_TIMEOUT
+#define RREP_ACK_TIMEOUT ROUTE_DISCOVERY_CONF_RREP_ACK_TIMEOUT
+#else /* ROUTE_DISCOVERY_CONF_RREP_ACK_TIMEOUT */
+#define RREP_ACK_TIMEOUT (3 * HOP_TIME + MAX_JITTER)
+#endif /* ROUTE_DISCOVERY_CONF_RREP_ACK_TIMEOUT */
+#ifdef ROUTE_DISCOVERY_CONF_RREP_MAX_RETRIES
+#define RREP_MAX_RETRIES ROUTE_DISCOVERY_CONF_RREP_MAX_RETRIES
+#else /* ROUTE_DISCOVERY_CONF_RREP_MAX_RETRIES */
+#define RREP_MAX_RETRIES 2
+#endif /* ROUTE_DISCOVERY_CONF_RREP_MAX_RETRIES */
+#define NUM_RREP_ENTRIES 4	//RREPs that can wait for their RREP-ACK at once
+#ifdef ROUTE_DISCOVERY_CONF_ACK_REQUIRED
+#define ACK_REQUIRED ROUTE_DISCOVERY_CONF_ACK_REQUIRED
+#else /* ROUTE_DISCOVERY_CONF_ACK_REQUIRED */
 #define ACK_REQUIRED 1
-#define METRICS 0
+#endif /* ROUTE_DISCOVERY_CONF_ACK_REQUIRED */
+/*
+ * Destinations whose discovery timed out are held down: they are reported
+ * by route_discovery_unreachable() and not looked for again before
+ * HOLD_DOWN has passed, a delay doubled at each further failure up to
+ * HOLD_DOWN << MAX_HOLD_DOWN_SHIFT.
+ */
+#ifdef ROUTE_DISCOVERY_CONF_HOLD_DOWN
+#define HOLD_DOWN ROUTE_DISCOVERY_CONF_HOLD_DOWN
+#else /* ROUTE_DISCOVERY_CONF_HOLD_DOWN */
+#define HOLD_DOWN (CLOCK_SECOND * 2)
+#endif /* ROUTE_DISCOVERY_CONF_HOLD_DOWN */
+#define MAX_HOLD_DOWN_SHIFT 5
+#ifdef ROUTE_DISCOVERY_CONF_UNREACHABLE_ENTRIES
+#define NUM_UNREACHABLE_ENTRIES ROUTE_DISCOVERY_CONF_UNREACHABLE_ENTRIES
+#else /* ROUTE_DISCOVERY_CONF_UNREACHABLE_ENTRIES */
+#define NUM_UNREACHABLE_ENTRIES 4
+#endif /* ROUTE_DISCOVERY_CONF_UNREACHABLE_ENTRIES */
+#define NUM_BATCHES 2	//multi-target RREQs that can be retried at once
+/*
+ * RREQ rate limiting. RREQs originated by this router and RREQs forwarded
+ * for others each draw from a token bucket refilled with *_RATE tokens per
+ * second and holding at most *_BURST of them; a RREQ finding its bucket
+ * empty is dropped. A rate of 0 disables the limit.
+ */
+#ifdef ROUTE_DISCOVERY_CONF_ORIGINATE_RATE
+#define ORIGINATE_RATE ROUTE_DISCOVERY_CONF_ORIGINATE_RATE
+#else /* ROUTE_DISCOVERY_CONF_ORIGINATE_RATE */
+#define ORIGINATE_RATE 2
+#endif /* ROUTE_DISCOVERY_CONF_ORIGINATE_RATE */
+#ifdef ROUTE_DISCOVERY_CONF_ORIGINATE_BURST
+#define ORIGINATE_BURST ROUTE_DISCOVERY_CONF_ORIGINATE_BURST
+#else /* ROUTE_DISCOVERY_CONF_ORIGINATE_BURST */
+#define ORIGINATE_BURST 4
+#endif /* ROUTE_DISCOVERY_CONF_ORIGINATE_BURST */
+#ifdef ROUTE_DISCOVERY_CONF_FORWARD_RATE
+#define FORWARD_RATE ROUTE_DISCOVERY_CONF_FORWARD_RATE
+#else /* ROUTE_DISCOVERY_CONF_FORWARD_RATE */
+#define FORWARD_RATE 5
+#endif /* ROUTE_DISCOVERY_CONF_FORWARD_RATE */
+#ifdef ROUTE_DISCOVERY_CONF_FORWARD_BURST
+#define FORWARD_BURST ROUTE_DISCOVERY_CONF_FORWARD_BURST
+#else /* ROUTE_DISCOVERY_CONF_FORWARD_BURST */
+#define FORWARD_BURST 8
+#endif /* ROUTE_DISCOVERY_CONF_FORWARD_BURST */
 #define MAX_HOP_COUNT 255
 #define MAX_HOP_LIMIT 255
+/*
+ * Expanding ring search. The first RREQ of a discovery only travels
+ * RING_START hops, or RING_INCREMENT past the hop count of the last route
+ * to the destination if one is remembered. Each retry widens the ring by
+ * RING_INCREMENT; past RING_THRESHOLD, and on the last retry, the RREQ
+ * floods the whole network. RING_START 0 disables the ring search.
+ */
+#ifdef ROUTE_DISCOVERY_CONF_RING_START
+#define RING_START ROUTE_DISCOVERY_CONF_RING_START
+#else /* ROUTE_DISCOVERY_CONF_RING_START */
+#define RING_START 2
+#endif /* ROUTE_DISCOVERY_CONF_RING_START */
+#ifdef ROUTE_DISCOVERY_CONF_RING_INCREMENT
+#define RING_INCREMENT ROUTE_DISCOVERY_CONF_RING_INCREMENT
+#else /* ROUTE_DISCOVERY_CONF_RING_INCREMENT */
+#define RING_INCREMENT 2
+#endif /* ROUTE_DISCOVERY_CONF_RING_INCREMENT */
+#ifdef ROUTE_DISCOVERY_CONF_RING_THRESHOLD
+#define RING_THRESHOLD ROUTE_DISCOVERY_CONF_RING_THRESHOLD
+#else /* ROUTE_DISCOVERY_CONF_RING_THRESHOLD */
+#define RING_THRESHOLD 7
+#endif /* ROUTE_DISCOVERY_CONF_RING_THRESHOLD */
+/*
+ * An attempt reaching hop_limit hops waits at least HOP_RTT per hop, the
+ * RREQ and its forwarding jitter out and the RREP back, for at most
+ * NET_DIAMETER hops.
+ */
+#define HOP_RTT (2 * HOP_TIME + MAX_JITTER)
+#ifdef ROUTE_DISCOVERY_CONF_NET_DIAMETER
+#define NET_DIAMETER ROUTE_DISCOVERY_CONF_NET_DIAMETER
+#else /* ROUTE_DISCOVERY_CONF_NET_DIAMETER */
+#define NET_DIAMETER 10
+#endif /* ROUTE_DISCOVERY_CONF_NET_DIAMETER */
 
 /*Defines*/
 #define MAXVALUE 255
@@ -125,11 +274,97 @@ typedef struct rerr_message_struture {
 #define SENDREP 1
 #define FORWARD 2
 #define DROP 3
+/* Wrap-around safe check whether clock time a has reached clock time b. */
+#define TIME_HALF_RANGE ((clock_time_t)~(clock_time_t)0 >> 1)
+#define TIME_REACHED(a, b) ((clock_time_t)((a) - (b)) <= TIME_HALF_RANGE)
 #define MAXA(A,B) ( ((A>B)&&((A-B)<=(MAXVALUE/2)))||((A<B)&&((B-A)>(MAXVALUE/2))) )
 
-static uint8_t rreq_seqno = 0;
-static uint8_t rrep_seqno = 0;
-static char rrep_pending = 0;
+//Sequence number of this router, shared by the RREQs and RREPs it originates
+//so that other routers can compare the freshness of routes towards it.
+static uint8_t own_seqno = 0;
+
+//The discoveries sent in one multi-target RREQ. They share a single timer
+//and are retried together, as one multi-target RREQ of those still
+//unresolved.
+struct discovery_batch {
+	struct discovery_batch *next;
+	struct route_discovery_conn *c;
+	struct ctimer t;
+	clock_time_t wait;	//how long the current attempt waits for RREPs
+	uint8_t retries;	//RREQs re-sent so far
+};
+
+LIST(batch_list);
+MEMB(batch_mem, struct discovery_batch, NUM_BATCHES);
+
+//A route discovery in flight, one per destination. The RREQs go out on the
+//connection c; every connection in waiters hears of the outcome. A
+//discovery in a batch has no timer of its own.
+struct discovery_entry {
+	struct discovery_entry *next;
+	struct route_discovery_conn *c;
+	struct route_discovery_conn *waiters[ROUTE_DISCOVERY_WAITERS];
+	uint8_t num_waiters;
+	rimeaddr_t dest;
+	struct ctimer t;
+	clock_time_t wait;	//how long the current attempt waits for a RREP
+	uint8_t retries;	//RREQs re-sent so far
+	uint8_t ring;	//hop_limit of the last RREQ sent
+	uint8_t repair;	//a local repair, see route_discovery_repairs()
+	struct discovery_batch *batch;
+};
+
+LIST(discovery_list);
+MEMB(discovery_mem, struct discovery_entry, ROUTE_DISCOVERY_ENTRIES);
+
+//A destination whose last discovery failed, oldest first.
+struct unreachable_entry {
+	struct unreachable_entry *next;
+	rimeaddr_t dest;
+	clock_time_t until;	//absolute time at which the hold-down ends
+	uint8_t failures;	//discoveries timed out in a row
+};
+
+LIST(unreachable_list);
+MEMB(unreachable_mem, struct unreachable_entry, NUM_UNREACHABLE_ENTRIES);
+
+//A token bucket of the RREQ rate limiter.
+struct rreq_bucket {
+	clock_time_t last;	//time at which the last token was added
+	uint8_t tokens;
+	uint8_t primed;	//0 until first used, when the bucket starts full
+};
+
+static struct rreq_bucket originate_bucket, forward_bucket;
+static struct route_discovery_stats stats;
+
+#if ACK_REQUIRED
+//A RREP waiting for the RREP-ACK of its next hop.
+struct rrep_retx_entry {
+	struct rrep_retx_entry *next;
+	struct route_discovery_conn *c;
+	struct ctimer t;
+	rimeaddr_t nexthop;
+	rrep_message msg;
+	uint8_t retries;	//retransmissions so far
+};
+
+LIST(rrep_retx_list);
+MEMB(rrep_retx_mem, struct rrep_retx_entry, NUM_RREP_ENTRIES);
+#endif /* ACK_REQUIRED */
+
+#if JITTER
+//A RREQ waiting for its forwarding jitter to expire.
+struct rreq_forward_entry {
+	struct rreq_forward_entry *next;
+	struct route_discovery_conn *c;
+	struct ctimer t;
+	struct rreq_multi_message msg;	//or a plain rreq_message, see rreq_len()
+};
+
+LIST(rreq_forward_list);
+MEMB(rreq_forward_mem, struct rreq_forward_entry, NUM_REQ_ENTRIES);
+#endif /* JITTER */
 
 /*------------------------------------------------------------------------------------------------------------------------*/
 /*check if rreq or rrep is valid return 0 means valid return -1 means invalid*/
@@ -144,13 +379,19 @@ int valid_check(struct general_message *input, const rimeaddr_t *from){
 	      return FALSE;
 	}
 
+	if(input->metric_type != ROUTE_METRIC){
+	      PRINTF("valid_check: Receive message with unsupported metric type %d\n",
+	    		  input->metric_type);
+	      return FALSE;
+	}
+
 	rt = route_lookup(&input->originator);
 	if((rt!=NULL) && MAXA(rt->R_seq_num,input->seqno) ){
 	      PRINTF("valid_check: Receive RREQ originator in already in routing table\n");
 	      return FALSE;
 	}
 	//TODO: received address is not present as rimeaddr_t
-	if(input->type == RREQ_TYPE ){
+	if(input->type == RREQ_TYPE || input->type == RREQ_MULTI_TYPE){
 		bl = route_blacklist_lookup(from);
 		if(bl!=NULL){
 			PRINTF("valid_check:Receive RREQ previous is in black list\n");
@@ -160,24 +401,283 @@ int valid_check(struct general_message *input, const rimeaddr_t *from){
 	return TRUE;
 }
 /*------------------------------------------------------------------------------------------------------------------------*/
+//Looks for the discovery in flight for dest, whatever connection runs it.
+static struct discovery_entry *
+discovery_lookup(const rimeaddr_t *dest)
+{
+	struct discovery_entry *d;
 
+	for(d = list_head(discovery_list); d != NULL; d = list_item_next(d)) {
+		if(rimeaddr_cmp(&d->dest, dest)) {
+			return d;
+		}
+	}
+	return NULL;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Returns a discovery of batch b, or NULL once they have all ended.
+static struct discovery_entry *
+batch_member(struct discovery_batch *b)
+{
+	struct discovery_entry *d;
 
+	for(d = list_head(discovery_list); d != NULL; d = list_item_next(d)) {
+		if(d->batch == b) {
+			return d;
+		}
+	}
+	return NULL;
+}
 /*------------------------------------------------------------------------------------------------------------------------*/
 static void
-send_rreq(struct route_discovery_conn *c, rreq_message *input)
+batch_remove(struct discovery_batch *b)
 {
-	rreq_message *msg;
-	packetbuf_clear();
-	msg = packetbuf_dataptr();
-	packetbuf_set_datalen(sizeof(rreq_message));
-	msg->type = RREQ_TYPE;
-	msg->metric_type = input->metric_type;
-	msg->route_metric = input->route_metric;
-	msg->seqno = input->seqno;
-	msg->hop_count = input->hop_count;
-	msg->hop_limit = input->hop_limit;
-	rimeaddr_copy(&msg->destination,&input->destination);
-	rimeaddr_copy(&msg->originator,&input->originator);
+	ctimer_stop(&b->t);
+	list_remove(batch_list, b);
+	memb_free(&batch_mem, b);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Ends a discovery, stopping its timer and releasing its entry, and its
+//batch with the last of its discoveries.
+static void
+discovery_remove(struct discovery_entry *d)
+{
+	struct discovery_batch *b = d->batch;
+
+	ctimer_stop(&d->t);
+	list_remove(discovery_list, d);
+	memb_free(&discovery_mem, d);
+	if(b != NULL && batch_member(b) == NULL) {
+		batch_remove(b);
+	}
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Adds c to the connections waiting for discovery d. Returns 0 if there is
+//no room left for it.
+static int
+discovery_join(struct discovery_entry *d, struct route_discovery_conn *c)
+{
+	uint8_t i;
+
+	for(i = 0; i < d->num_waiters; i++) {
+		if(d->waiters[i] == c) {
+			return 1;
+		}
+	}
+	if(d->num_waiters == ROUTE_DISCOVERY_WAITERS) {
+		PRINTF("discovery_join: too many connections waiting for %d.%d\n",
+			d->dest.u8[0], d->dest.u8[1]);
+		return 0;
+	}
+	d->waiters[d->num_waiters++] = c;
+	return 1;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Ends discovery d and tells every connection that waited for it, through
+//new_route if found is set and through timedout_to or timedout otherwise.
+static void
+discovery_complete(struct discovery_entry *d, int found)
+{
+	struct route_discovery_conn *waiters[ROUTE_DISCOVERY_WAITERS];
+	uint8_t num_waiters, i;
+	rimeaddr_t dest;
+
+	/* The callbacks may start new discoveries, so d is released first. */
+	rimeaddr_copy(&dest, &d->dest);
+	num_waiters = d->num_waiters;
+	memcpy(waiters, d->waiters, sizeof(waiters));
+	discovery_remove(d);
+
+	for(i = 0; i < num_waiters; i++) {
+		if(found) {
+			if(waiters[i]->cb->new_route) {
+				waiters[i]->cb->new_route(waiters[i], &dest);
+			}
+		} else if(waiters[i]->cb->timedout_to) {
+			waiters[i]->cb->timedout_to(waiters[i], &dest);
+		} else if(waiters[i]->cb->timedout) {
+			waiters[i]->cb->timedout(waiters[i]);
+		}
+	}
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+static struct unreachable_entry *
+unreachable_lookup(const rimeaddr_t *dest)
+{
+	struct unreachable_entry *e;
+
+	for(e = list_head(unreachable_list); e != NULL; e = list_item_next(e)) {
+		if(rimeaddr_cmp(&e->dest, dest)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+static void
+unreachable_remove(struct unreachable_entry *e)
+{
+	if(e != NULL) {
+		list_remove(unreachable_list, e);
+		memb_free(&unreachable_mem, e);
+	}
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Holds dest down after a failed discovery, twice as long as the last time
+//if it had already failed. The oldest entry makes room when the set is full.
+static void
+unreachable_add(const rimeaddr_t *dest)
+{
+	struct unreachable_entry *e;
+
+	e = unreachable_lookup(dest);
+	if(e != NULL) {
+		list_remove(unreachable_list, e);
+		if(e->failures <= MAX_HOLD_DOWN_SHIFT) {
+			e->failures++;
+		}
+	} else {
+		e = memb_alloc(&unreachable_mem);
+		if(e == NULL) {
+			e = list_pop(unreachable_list);
+		}
+		rimeaddr_copy(&e->dest, dest);
+		e->failures = 1;
+	}
+	e->until = clock_time() + ((clock_time_t)HOLD_DOWN << (e->failures - 1));
+	list_add(unreachable_list, e);
+	PRINTF("unreachable_add: holding %d.%d down, failure %d\n",
+		dest->u8[0], dest->u8[1], e->failures);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Takes a token from bucket b, refilled with rate tokens per second up to
+//burst. Returns 0 if the bucket is empty and the RREQ must be dropped.
+static int
+rreq_bucket_take(struct rreq_bucket *b, uint8_t rate, uint8_t burst)
+{
+	clock_time_t now, interval;
+	clock_time_t added;
+
+	if(rate == 0) {
+		return 1;
+	}
+	now = clock_time();
+	if(!b->primed) {
+		b->primed = 1;
+		b->tokens = burst;
+		b->last = now;
+	}
+	interval = CLOCK_SECOND / rate;
+	if(interval == 0) {
+		interval = 1;
+	}
+	added = (clock_time_t)(now - b->last) / interval;
+	if(added >= (clock_time_t)(burst - b->tokens)) {
+		b->tokens = burst;
+		b->last = now;
+	} else {
+		b->tokens += added;
+		b->last += added * interval;
+	}
+	if(b->tokens == 0) {
+		return 0;
+	}
+	b->tokens--;
+	return 1;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Returns 0 if the rate limiter does not allow this router to originate
+//another RREQ, for addr, yet.
+static int
+originate_allowed(const rimeaddr_t *addr)
+{
+	if(!rreq_bucket_take(&originate_bucket, ORIGINATE_RATE, ORIGINATE_BURST)) {
+		stats.originate_dropped++;
+		PRINTF("route_discovery_send: rate limited, ignoring request to %d.%d\n",
+			addr->u8[0], addr->u8[1]);
+		return 0;
+	}
+	return 1;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Returns the cost of the route towards the originator of msg through the
+//neighbor from, which is also the route_metric of msg when forwarded.
+static uint16_t
+path_cost(struct general_message *msg, const rimeaddr_t *from)
+{
+	return ROUTE_METRIC_ACCUMULATE(msg->route_metric, ROUTE_METRIC_LINK_COST(from));
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Returns the number of weak links on the route towards the originator of
+//msg through the neighbor from.
+static uint8_t
+path_weak_links(struct general_message *msg, const rimeaddr_t *from)
+{
+	uint8_t weak_links = msg->weak_links;
+
+	if(ROUTE_METRIC_WEAK_LINK(from) && weak_links < ROUTE_METRIC_MAX_WEAK_LINKS) {
+		weak_links++;
+	}
+	return weak_links;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+/*
+ * Applies the LOADng route update rules to the route towards the originator
+ * of a RREQ or RREP received from the neighbor from: a newer sequence number
+ * wins, and with an equal sequence number a better distance, fewer weak
+ * links first and then a lower route cost, wins.
+ * Returns 1 if the message created or updated that route, 0 otherwise; a
+ * message that was not used for updating is not processed any further.
+ */
+static int
+update_route(struct general_message *msg, const rimeaddr_t *from)
+{
+	struct route_entry *rt;
+	struct dist_tuple new_tup;
+
+	new_tup.weak_links = path_weak_links(msg, from);
+	new_tup.padding = 0;
+	new_tup.route_cost = path_cost(msg, from);
+	new_tup.hops = msg->hop_count + 1;
+
+	rt = route_lookup(&msg->originator);
+	if(rt==NULL){
+		return route_add(&msg->originator, from, &new_tup, msg->seqno) != NULL;
+	}
+	if(MAXA(msg->seqno, rt->R_seq_num) ||
+			(msg->seqno == rt->R_seq_num && ROUTE_METRIC_BETTER(&new_tup, &rt->R_dist))){
+		route_update(rt, from, &new_tup, msg->seqno);
+		return 1;
+	}
+	if(msg->seqno == rt->R_seq_num && !rimeaddr_cmp(&rt->R_next_addr, from)){
+		//the same message heard through another neighbor, keep it as an alternate
+		route_add(&msg->originator, from, &new_tup, msg->seqno);
+	}
+	PRINTF("update_route: message from %d.%d seqno %d cost %d does not improve route to %d.%d\n",
+		from->u8[0], from->u8[1], msg->seqno, new_tup.route_cost,
+		msg->originator.u8[0], msg->originator.u8[1]);
+	return 0;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Returns the length of the RREQ msg, which is the hdr of a struct
+//rreq_multi_message if it is of type RREQ_MULTI_TYPE.
+static uint8_t
+rreq_len(const rreq_message *msg)
+{
+	if(msg->type == RREQ_MULTI_TYPE) {
+		return offsetof(struct rreq_multi_message, targets) +
+			((const struct rreq_multi_message *)msg)->num_targets * sizeof(rimeaddr_t);
+	}
+	return sizeof(rreq_message);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Floods the RREQ in packetbuf, either built by send_rreq() or received and
+//updated in place for forwarding.
+static void
+send_rreq_packetbuf(struct route_discovery_conn *c)
+{
+	rreq_message *msg = packetbuf_dataptr();
+
 	//netflood_send(&c->rreqconn, c->rreq_id);
 	netflood_send(&c->rreqconn, msg->seqno);
 	//c->rreq_id++;
@@ -188,25 +688,101 @@ send_rreq(struct route_discovery_conn *c, rreq_message *input)
 	   msg->destination.u8[0], msg->destination.u8[1],
 	   msg->route_metric, msg->hop_count, msg->seqno);
 }
+/*------------------------------------------------------------------------------------------------------------------------*/
+static void
+send_rreq(struct route_discovery_conn *c, rreq_message *input)
+{
+	packetbuf_copyfrom(input, rreq_len(input));
+	send_rreq_packetbuf(c);
+}
+
+/*------------------------------------------------------------------------------------------------------------------------*/
+#if ACK_REQUIRED
+static struct rrep_retx_entry *
+rrep_retx_lookup(const rimeaddr_t *nexthop, const rimeaddr_t *originator, uint8_t seqno)
+{
+	struct rrep_retx_entry *r;
 
+	for(r = list_head(rrep_retx_list); r != NULL; r = list_item_next(r)) {
+		if(r->msg.seqno == seqno && rimeaddr_cmp(&r->nexthop, nexthop) &&
+				rimeaddr_cmp(&r->msg.originator, originator)) {
+			return r;
+		}
+	}
+	return NULL;
+}
 /*------------------------------------------------------------------------------------------------------------------------*/
 static void
-send_rrep(struct route_discovery_conn *c, rrep_message *input)
+rrep_retx_remove(struct rrep_retx_entry *r)
+{
+	ctimer_stop(&r->t);
+	list_remove(rrep_retx_list, r);
+	memb_free(&rrep_retx_mem, r);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Sends the RREP of r again, or gives up on it once RREP_MAX_RETRIES is
+//reached and the last ACK window has closed, blacklisting the next hop.
+static void
+rrep_retx_timeout(void *ptr)
+{
+	struct rrep_retx_entry *r = ptr;
+
+	if(r->retries >= RREP_MAX_RETRIES) {
+		PRINTF("rrep_retx_timeout: no RREP-ACK from %d.%d\n",
+			r->nexthop.u8[0], r->nexthop.u8[1]);
+		pending_expire(route_pending_list_lookup(&r->nexthop,
+				&r->msg.originator, r->msg.seqno));
+		rrep_retx_remove(r);
+		return;
+	}
+	r->retries++;
+	PRINTF("rrep_retx_timeout: resending RREP to %d.%d, retry %d\n",
+		r->nexthop.u8[0], r->nexthop.u8[1], r->retries);
+	packetbuf_copyfrom(&r->msg, sizeof(rrep_message));
+	unicast_send(&r->c->rrepconn, &r->nexthop);
+	ctimer_set(&r->t, RREP_ACK_TIMEOUT, rrep_retx_timeout, r);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Waits for the RREP-ACK of the RREP msg about to be sent to nexthop. msg is
+//copied, as packetbuf no longer holds it once sent.
+static void
+rrep_retx_add(struct route_discovery_conn *c, rrep_message *msg, const rimeaddr_t *nexthop)
+{
+	struct rrep_retx_entry *r;
+
+	/* The retransmissions decide when to blacklist. The Pending
+	   Acknowledgement Set only does it itself for a RREP that could not be
+	   retransmitted, one ACK window after the retransmissions would have
+	   ended, so that it never races with them. */
+	route_pending_add(nexthop, &msg->originator, msg->seqno,
+			RREP_ACK_TIMEOUT * (RREP_MAX_RETRIES + 2));
+
+	r = rrep_retx_lookup(nexthop, &msg->originator, msg->seqno);
+	if(r == NULL) {
+		r = memb_alloc(&rrep_retx_mem);
+		if(r == NULL) {
+			/* Not retransmitted, but still blacklisted if never acknowledged. */
+			return;
+		}
+		list_add(rrep_retx_list, r);
+	}
+	r->c = c;
+	rimeaddr_copy(&r->nexthop, nexthop);
+	memcpy(&r->msg, msg, sizeof(rrep_message));
+	r->retries = 0;
+	ctimer_set(&r->t, RREP_ACK_TIMEOUT, rrep_retx_timeout, r);
+}
+#endif /* ACK_REQUIRED */
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Unicasts the RREP in packetbuf towards its destination, either built by
+//send_rrep() or received and updated in place for forwarding.
+static void
+send_rrep_packetbuf(struct route_discovery_conn *c)
 {
 	struct route_entry *rt;
-	rrep_message *msg;
-	packetbuf_clear();
-	msg = packetbuf_dataptr();
-	packetbuf_set_datalen(sizeof( rrep_message));
-	msg->type = RREP_TYPE;
-	msg->metric_type = input->metric_type;
-	msg->route_metric = input->route_metric;
-	msg->seqno = input->seqno;
-	msg->hop_count = 0;
-	msg->hop_limit = MAX_HOP_LIMIT;
-	rimeaddr_copy(&msg->destination,&input->destination);
-	rimeaddr_copy(&msg->originator,&input->originator);
+	rrep_message *msg = packetbuf_dataptr();
 
+	msg->ackrequired = ACK_REQUIRED;
 	rt = route_lookup(&msg->destination);
 	if(rt != NULL) {
 	    PRINTF("send_rrep: %d.%d: send_rrep to %d.%d via %d.%d "
@@ -217,6 +793,9 @@ send_rrep(struct route_discovery_conn *c, rrep_message *input)
 		   msg->originator.u8[0], msg->originator.u8[1],
 		   msg->destination.u8[0], msg->destination.u8[1],
 		   msg->route_metric, msg->hop_count, msg->seqno);
+#if ACK_REQUIRED
+	    rrep_retx_add(c, msg, &rt->R_next_addr);
+#endif /* ACK_REQUIRED */
 	    unicast_send(&c->rrepconn, &rt->R_next_addr);
 	} else {
 		PRINTF("send_rrep: no route entry from %d.%d to %d.%d\n",
@@ -224,31 +803,37 @@ send_rrep(struct route_discovery_conn *c, rrep_message *input)
 			msg->destination.u8[0],msg->destination.u8[1]);
 	}
 }
+/*------------------------------------------------------------------------------------------------------------------------*/
+static void
+send_rrep(struct route_discovery_conn *c, rrep_message *input)
+{
+	packetbuf_copyfrom(input, sizeof(rrep_message));
+	send_rrep_packetbuf(c);
+}
 
 /*------------------------------------------------------------------------------------------------------------------------*/
+//Acknowledges a RREP to the neighbor it was received from.
 static void
-send_rrep_ack(struct route_discovery_conn *c, rrep_ack_message *input)
+send_rrep_ack(struct route_discovery_conn *c, rrep_ack_message *input,
+		const rimeaddr_t *to)
 {
-	struct route_entry *rt;
 	rrep_ack_message *msg;
 	packetbuf_clear();
 	msg = packetbuf_dataptr();
 	packetbuf_set_datalen(sizeof(rrep_ack_message));
+	msg->type = RREP_ACK_TYPE;
 	msg->seqno = input->seqno;
 	rimeaddr_copy(&msg->destination,&input->destination);
 
-	rt = route_lookup(&msg->destination);
-	if(rt != NULL) {
-	    PRINTF("send_rrep_ack: %d.%d: send_rrep to %d.%d via %d.%d\n",
-		   rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
-		   msg->destination.u8[0],msg->destination.u8[1],
-		   rt->R_next_addr.u8[0],rt->R_next_addr.u8[1]);
-	    unicast_send(&c->rrepconn, &rt->R_next_addr);
-	}
-
+	PRINTF("send_rrep_ack: %d.%d: send_rrep_ack to %d.%d orig: %d.%d seqno: %d\n",
+	   rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+	   to->u8[0], to->u8[1],
+	   msg->destination.u8[0], msg->destination.u8[1], msg->seqno);
+	unicast_send(&c->rrepconn, to);
 }
 /*------------------------------------------------------------------------------------------------------------------------*/
-static void
+//Sends a RERR towards its destination. Returns 0 if there is no route to it.
+static int
 send_rerr(struct route_discovery_conn *c, rerr_message *input)
 {
 	struct route_entry *rt;
@@ -257,6 +842,7 @@ send_rerr(struct route_discovery_conn *c, rerr_message *input)
 	msg = packetbuf_dataptr();
 	packetbuf_set_datalen(sizeof( rerr_message));
 
+	msg->type = RERR_TYPE;
 	msg->errorcode = input->errorcode;
 	msg->hop_limit = input->hop_limit;
 	rimeaddr_copy(&msg->unreachable,&input->unreachable);
@@ -265,22 +851,128 @@ send_rerr(struct route_discovery_conn *c, rerr_message *input)
 
 	rt = route_lookup(&msg->destination);
 	if(rt != NULL) {
-	    PRINTF("send_rerr: %d.%d: send_rrep to %d.%d via %d.%d\n",
+	    PRINTF("send_rerr: %d.%d: send_rerr to %d.%d via %d.%d unreachable: %d.%d\n",
 		   rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
 		   msg->destination.u8[0],msg->destination.u8[1],
-		   rt->R_next_addr.u8[0],rt->R_next_addr.u8[1]);
+		   rt->R_next_addr.u8[0],rt->R_next_addr.u8[1],
+		   msg->unreachable.u8[0],msg->unreachable.u8[1]);
 	    unicast_send(&c->rrepconn, &rt->R_next_addr);
+	    return 1;
 	}
+	PRINTF("send_rerr: no route entry to %d.%d\n",
+		msg->destination.u8[0],msg->destination.u8[1]);
+	return 0;
 }
 
+/*------------------------------------------------------------------------------------------------------------------------*/
+#if JITTER
+//Draws the forwarding delay of a RREQ from the JITTER distribution.
+static clock_time_t
+forward_jitter(void)
+{
+	uint32_t ms;
+#if JITTER == EXPONENTIAL
+	uint32_t x;
+	uint16_t nlog2;
+	uint8_t msb;
+
+	/* -ln(u) for u uniform in (0, 1], through a piecewise linear log2 in
+	   8-bit fixed point; ln(2) is 177/256. */
+	x = (uint32_t)random_rand() + 1;
+	for(msb = 0; (x >> (msb + 1)) != 0; msb++);
+	nlog2 = (16 << 8) - ((msb << 8) + (((x << 8) >> msb) - 256));
+	ms = ((uint32_t)MEAN_BACKOFF * nlog2 * 177) >> 16;
+	if(ms > 8 * MEAN_BACKOFF) {
+		ms = 8 * MEAN_BACKOFF;
+	}
+#else /* JITTER == EXPONENTIAL */
+	ms = random_rand() % (2 * MEAN_BACKOFF + 1);
+#endif /* JITTER == EXPONENTIAL */
+	return (clock_time_t)((ms * CLOCK_SECOND) / 1000);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+static void
+rreq_forward_timeout(void *ptr)
+{
+	struct rreq_forward_entry *f = ptr;
+
+	list_remove(rreq_forward_list, f);
+	send_rreq(f->c, &f->msg.hdr);
+	memb_free(&rreq_forward_mem, f);
+}
+#endif /* JITTER */
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Forwards msg, the RREQ in packetbuf already updated for the next hop, after
+//the forwarding jitter. A RREQ already waiting for the same originator and
+//seqno is replaced by the newer, better copy.
+//Returns 0 if the rate limiter dropped the RREQ.
+static int
+forward_rreq(struct route_discovery_conn *c, rreq_message *msg)
+{
+#if JITTER
+	struct rreq_forward_entry *f;
+
+	for(f = list_head(rreq_forward_list); f != NULL; f = list_item_next(f)) {
+		if(f->c == c && f->msg.hdr.seqno == msg->seqno &&
+				rimeaddr_cmp(&f->msg.hdr.originator, &msg->originator)) {
+			memcpy(&f->msg, msg, rreq_len(msg));
+			return 1;
+		}
+	}
+#endif /* JITTER */
+
+	/* Only RREQs actually sent cost a token, not the better copies of one
+	   already waiting. */
+	if(!rreq_bucket_take(&forward_bucket, FORWARD_RATE, FORWARD_BURST)) {
+		stats.forward_dropped++;
+		PRINTF("forward_rreq: rate limited, dropping RREQ from %d.%d\n",
+			msg->originator.u8[0], msg->originator.u8[1]);
+		return 0;
+	}
+
+#if JITTER
+	f = memb_alloc(&rreq_forward_mem);
+	if(f == NULL) {
+		PRINTF("forward_rreq: jitter queue full, forwarding at once\n");
+		send_rreq_packetbuf(c);
+		return 1;
+	}
+	f->c = c;
+	memcpy(&f->msg, msg, rreq_len(msg));
+	list_add(rreq_forward_list, f);
+	ctimer_set(&f->t, forward_jitter(), rreq_forward_timeout, f);
+#else /* JITTER */
+	send_rreq_packetbuf(c);
+#endif /* JITTER */
+	return 1;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Answers a RREQ for this router with a RREP towards its originator.
+static void
+reply_rreq(struct route_discovery_conn *c, const rimeaddr_t *originator)
+{
+	rrep_message new_msg;
+
+	new_msg.type = RREP_TYPE;
+	new_msg.metric_type = ROUTE_METRIC;
+	new_msg.route_metric = 0;
+	new_msg.seqno = own_seqno;
+	own_seqno++;
+	new_msg.hop_count = 0;
+	new_msg.weak_links = 0;
+	new_msg.hop_limit = MAX_HOP_LIMIT;
+	rimeaddr_copy(&new_msg.destination, originator);
+	rimeaddr_copy(&new_msg.originator, &rimeaddr_node_addr);
+	send_rrep(c, &new_msg);
+}
 /*------------------------------------------------------------------------------------------------------------------------*/
 static int
 rreq_msg_received(struct netflood_conn *nf, const rimeaddr_t *from)
 {
 	int ret_val = 0;
-	rreq_message *msg = packetbuf_dataptr();
-	struct general_message new_msg;	//the new msg, can be either rreq pr rrep
-	struct route_entry *rt;
+	rreq_message *msg = packetbuf_dataptr();	//updated in place when forwarded
+	uint32_t route_metric;
+	uint8_t weak_links;
 	struct route_discovery_conn *c = (struct route_discovery_conn *)
     ((char *)nf - offsetof(struct route_discovery_conn, rreqconn));
 
@@ -296,22 +988,8 @@ rreq_msg_received(struct netflood_conn *nf, const rimeaddr_t *from)
 	if(ret_val!=0){
 		return ret_val;
 	}
-	rimeaddr_copy(&new_msg.destination,&msg->destination);
-	rimeaddr_copy(&new_msg.originator,&msg->originator);
-	rt = route_lookup(&msg->originator);
-	if(rt==NULL){
-		//TODO:check if route_add done 11.2.7 and check input parameter
-		//route_add the third parameter should be metric?
-		struct dist_tuple new_tup;
-		new_tup.weak_links = 0;
-		new_tup.route_cost = msg->hop_count + 1;
-		route_add(&msg->originator, from, &new_tup, msg->seqno);
-	}
-	else{
-		//TODO:
-		//route check to see if it need to be update
-		//route_remove(struct route_entry *e);
-		//route_add();
+	if(!update_route(msg, from)){
+		return DROP;
 	}
 
     if(rimeaddr_cmp(&msg->destination, &rimeaddr_node_addr)) {
@@ -321,19 +999,7 @@ rreq_msg_received(struct netflood_conn *nf, const rimeaddr_t *from)
 	     from->u8[0], from->u8[1],
 	     packetbuf_attr(PACKETBUF_ATTR_RSSI),
 	     packetbuf_attr(PACKETBUF_ATTR_LINK_QUALITY));
-	  //generate new rrep
-		new_msg.type = RREP_TYPE;
-		new_msg.metric_type = 0;
-		new_msg.route_metric = 0;
-		new_msg.seqno = rrep_seqno;
-		rrep_seqno++;
-		new_msg.hop_count = 0;
-		new_msg.hop_limit = MAX_HOP_LIMIT;
-		rimeaddr_t temp_dest;
-		rimeaddr_copy(&temp_dest,&new_msg.destination);
-		rimeaddr_copy(&new_msg.destination,&new_msg.originator);
-		rimeaddr_copy(&new_msg.originator,&temp_dest);
-      send_rrep(c, &new_msg);
+      reply_rreq(c, &msg->originator);
       return SENDREP; /* Don't continue to flood the rreq packet. */
     }
     else {
@@ -343,82 +1009,125 @@ rreq_msg_received(struct netflood_conn *nf, const rimeaddr_t *from)
 	     packetbuf_attr(PACKETBUF_ATTR_RSSI),
 	     packetbuf_attr(PACKETBUF_ATTR_LINK_QUALITY));
       if(msg->hop_count < MAX_HOP_COUNT && msg->hop_limit >0){
-    		//TODO:weak link ?
-    		new_msg.hop_count = msg->hop_count + 1;
-    		new_msg.hop_limit = msg->hop_limit - 1;
-    		new_msg.route_metric = msg->hop_count + 1;
-    		new_msg.seqno = msg->seqno;
-    		//msg->metric_type = 0 means use hop otherwise use other metrics
-    		//TODO consider other metrics document 11.2.4 11.2.5
-    		new_msg.metric_type = msg->metric_type;
-    		new_msg.type = RREQ_TYPE;
-      		send_rreq(c,&new_msg);
+    		route_metric = path_cost(msg, from);
+    		weak_links = path_weak_links(msg, from);
+    		msg->route_metric = route_metric;
+    		msg->weak_links = weak_links;
+    		msg->hop_count++;
+    		msg->hop_limit--;
+      		if(!forward_rreq(c,msg)){
+      			return DROP;
+      		}
       		return FORWARD;
       }
     }
     return DROP;
 }
 /*------------------------------------------------------------------------------------------------------------------------*/
+//Handles a RREQ for several destinations: answers it if this router is one
+//of them, and forwards it for the others.
 static int
-rrep_msg_received(struct unicast_conn *uc, const rimeaddr_t *from)
+rreq_multi_received(struct netflood_conn *nf, const rimeaddr_t *from)
 {
-	int ret_val = 0;
-	rreq_message *msg = packetbuf_dataptr();
-	rreq_message new_msg;
-	struct route_entry *rt;
+	struct rreq_multi_message *msg = packetbuf_dataptr();	//updated in place when forwarded
+	rimeaddr_t originator;	//answering overwrites packetbuf
+	uint32_t route_metric;
+	uint8_t i, n, for_us, weak_links;
+	int ret_val;
 	struct route_discovery_conn *c = (struct route_discovery_conn *)
-	    ((char *)uc - offsetof(struct route_discovery_conn, rrepconn));
+	    ((char *)nf - offsetof(struct route_discovery_conn, rreqconn));
 
-	PRINTF("rrep_msg_received: %d.%d: rrep_msg_received from %d.%d "
-			"orig: %d.%d dest: %d.%d route_metric: %d hop_count: %d seqno: %d\n",
+	if(packetbuf_datalen() < offsetof(struct rreq_multi_message, targets) ||
+			msg->num_targets > ROUTE_DISCOVERY_MAX_TARGETS ||
+			rreq_len(&msg->hdr) != packetbuf_datalen()) {
+		PRINTF("rreq_multi_received: bad length %d from %d.%d\n",
+			packetbuf_datalen(), from->u8[0], from->u8[1]);
+		return DROP;
+	}
+	PRINTF("rreq_multi_received: %d.%d: multi-target rreq from %d.%d "
+			"orig: %d.%d targets: %d route_metric: %d hop_count: %d seqno: %d\n",
 	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
 	 from->u8[0], from->u8[1],
-	 msg->originator.u8[0], msg->originator.u8[1],
-	 msg->destination.u8[0], msg->destination.u8[1],
-	 msg->route_metric, msg->hop_count, msg->seqno);
+	 msg->hdr.originator.u8[0], msg->hdr.originator.u8[1],
+	 msg->num_targets, msg->hdr.route_metric, msg->hdr.hop_count, msg->hdr.seqno);
+
+	if(valid_check(&msg->hdr, from) != 0){
+		return FALSE;
+	}
+	if(!update_route(&msg->hdr, from)){
+		return DROP;
+	}
+
+	/* Take ourselves off the list, nobody further needs to look for us. */
+	for_us = 0;
+	for(i = 0, n = 0; i < msg->num_targets; i++) {
+		if(rimeaddr_cmp(&msg->targets[i], &rimeaddr_node_addr)) {
+			for_us = 1;
+		} else {
+			rimeaddr_copy(&msg->targets[n++], &msg->targets[i]);
+		}
+	}
+	msg->num_targets = n;
+	packetbuf_set_datalen(rreq_len(&msg->hdr));
+	rimeaddr_copy(&originator, &msg->hdr.originator);
+
+	/* Forwarded first, while the RREQ is still in packetbuf. */
+	ret_val = DROP;
+	if(n > 0 && msg->hdr.hop_count < MAX_HOP_COUNT && msg->hdr.hop_limit > 0) {
+		route_metric = path_cost(&msg->hdr, from);
+		weak_links = path_weak_links(&msg->hdr, from);
+		msg->hdr.route_metric = route_metric;
+		msg->hdr.weak_links = weak_links;
+		msg->hdr.hop_count++;
+		msg->hdr.hop_limit--;
+		if(forward_rreq(c, &msg->hdr)) {
+			ret_val = FORWARD;
+		}
+	}
+	if(for_us) {
+		PRINTF("rreq_multi_received: route request for our address\n");
+		reply_rreq(c, &originator);
+		ret_val = SENDREP;
+	}
+	return ret_val;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Handles the RREP msg in packetbuf, forwarding it in place if it is not for
+//us.
+static int
+rrep_msg_process(struct route_discovery_conn *c, rrep_message *msg,
+		const rimeaddr_t *from)
+{
+	int ret_val = 0;
+	uint32_t route_metric;
+	uint8_t weak_links;
+
 	ret_val = valid_check(msg, from);
 	if(ret_val!=0){
 		return ret_val;
 	}
 
-	rt = route_lookup(&msg->originator);
-	if(rt==NULL){
-		//TODO:check if route_add done 11.2.7 and check input parameter
-		//route_add the third parameter should be metric?
-		struct dist_tuple new_tup;
-		new_tup.weak_links = 0;
-		new_tup.route_cost = msg->hop_count + 1;
-		route_add(&msg->originator, from, &new_tup, msg->seqno);
-	}
-	else{
-		//TODO:
-		//route check to see if it need to be update
-		//route_remove(struct route_entry *e);
-		//route_add();
+	if(!update_route(msg, from)){
+		return DROP;
 	}
 
-	/*if(msg->ackrequired){
-		send_rrep_ack(c,new_msg);
-	}*/
 	if(!rimeaddr_cmp(&msg->destination, &rimeaddr_node_addr)) {
-		//TODO:weak link ?
-		new_msg.hop_count = msg->hop_count + 1;
-		new_msg.hop_limit = msg->hop_limit - 1;
-		new_msg.seqno = msg->seqno;
-		new_msg.route_metric = msg->hop_count + 1;
-		new_msg.type = msg->type;
-		//msg->metric_type = 0 means use hop otherwise use other metrics
-		//TODO consider other metrics document 11.2.4 11.2.5
-		new_msg.metric_type = msg->metric_type;
-		rimeaddr_copy(&new_msg.destination,&msg->destination);
-		rimeaddr_copy(&new_msg.originator,&msg->originator);
-		  send_rrep(c, &new_msg);
+		route_metric = path_cost(msg, from);
+		weak_links = path_weak_links(msg, from);
+		msg->route_metric = route_metric;
+		msg->weak_links = weak_links;
+		msg->hop_count++;
+		msg->hop_limit--;
+		  send_rrep_packetbuf(c);
 	      return SENDREP; /* Don't continue to flood the rreq packet. */
 	}else {
+	    struct discovery_entry *d;
 	    PRINTF("rrep_msg_received: rrep for us!\n");
-	    rrep_pending = 0;
-	    ctimer_stop(&c->t);
-	    if(c->cb->new_route) {
+	    unreachable_remove(unreachable_lookup(&msg->originator));
+	    d = discovery_lookup(&msg->originator);
+	    if(d != NULL) {
+	      discovery_complete(d, 1);
+	    } else if(c->cb->new_route) {
 	      rimeaddr_t originator;
 
 	      /* If the callback modifies the packet, the originator address
@@ -430,36 +1139,147 @@ rrep_msg_received(struct unicast_conn *uc, const rimeaddr_t *from)
 	}
 	return TRUE;
 }
+/*------------------------------------------------------------------------------------------------------------------------*/
+static int
+rrep_msg_received(struct unicast_conn *uc, const rimeaddr_t *from)
+{
+	int ret_val;
+	rrep_message *msg = packetbuf_dataptr();
+	rrep_ack_message ack;	//sent last, it overwrites packetbuf
+	uint8_t ackrequired;
+	struct route_discovery_conn *c = (struct route_discovery_conn *)
+	    ((char *)uc - offsetof(struct route_discovery_conn, rrepconn));
 
+	PRINTF("rrep_msg_received: %d.%d: rrep_msg_received from %d.%d "
+			"orig: %d.%d dest: %d.%d route_metric: %d hop_count: %d seqno: %d\n",
+	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+	 from->u8[0], from->u8[1],
+	 msg->originator.u8[0], msg->originator.u8[1],
+	 msg->destination.u8[0], msg->destination.u8[1],
+	 msg->route_metric, msg->hop_count, msg->seqno);
+
+	ackrequired = msg->ackrequired;
+	ack.seqno = msg->seqno;
+	rimeaddr_copy(&ack.destination, &msg->originator);
+
+	ret_val = rrep_msg_process(c, msg, from);
+
+	/* The link worked, acknowledge it even if the RREP is of no use to us. */
+	if(ackrequired){
+		send_rrep_ack(c, &ack, from);
+	}
+	return ret_val;
+}
+
+/*------------------------------------------------------------------------------------------------------------------------*/
+static void
+rrep_ack_received(struct route_discovery_conn *c, const rimeaddr_t *from)
+{
+	rrep_ack_message *msg = packetbuf_dataptr();
+	struct pending_entry *p;
+
+	PRINTF("rrep_ack_received: %d.%d: RREP-ACK from %d.%d orig: %d.%d seqno: %d\n",
+	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+	 from->u8[0], from->u8[1],
+	 msg->destination.u8[0], msg->destination.u8[1], msg->seqno);
+
+	p = route_pending_list_lookup(from, &msg->destination, msg->seqno);
+	if(p != NULL) {
+		pending_remove(p);
+	}
+	/* The neighbor heard us after all, the link works both ways. */
+	blacklist_remove(route_blacklist_lookup(from));
+#if ACK_REQUIRED
+	{
+		struct rrep_retx_entry *r;
+
+		r = rrep_retx_lookup(from, &msg->destination, msg->seqno);
+		if(r != NULL) {
+			rrep_retx_remove(r);
+		}
+	}
+#endif /* ACK_REQUIRED */
+}
 /*------------------------------------------------------------------------------------------------------------------------*/
+//Drops the route to the unreachable destination of a RERR if it goes through
+//the neighbor that sent the RERR, and passes the RERR on towards its
+//destination. Returns 1 if a route was removed.
 static int
-rerr_msg_process(struct unicast_conn *uc, const rimeaddr_t *from)
+rerr_msg_process(struct route_discovery_conn *c, const rimeaddr_t *from)
 {
-	rerr_message *msg = packetbuf_dataptr();
-	rerr_message new_msg;
+	rerr_message msg;	//forwarding the RERR overwrites packetbuf
 	struct route_entry *rt;
+
+	memcpy(&msg, packetbuf_dataptr(), sizeof(rerr_message));
+	PRINTF("rerr_msg_process: %d.%d: RERR from %d.%d orig: %d.%d dest: %d.%d unreachable: %d.%d\n",
+	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
+	 from->u8[0], from->u8[1],
+	 msg.originator.u8[0], msg.originator.u8[1],
+	 msg.destination.u8[0], msg.destination.u8[1],
+	 msg.unreachable.u8[0], msg.unreachable.u8[1]);
+
+	rt = route_lookup_via(&msg.unreachable, from);
+	route_remove(rt);
+
+	if(rimeaddr_cmp(&msg.destination, &rimeaddr_node_addr)) {
+		PRINTF("rerr_msg_process: rerr for us!\n");
+	} else if(msg.hop_limit > 0) {
+		msg.hop_limit--;
+		send_rerr(c, &msg);
+	}
+	return rt != NULL;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Unicast receive callback, dispatching on the message type.
+static void
+rrep_packet_received(struct unicast_conn *uc, const rimeaddr_t *from)
+{
 	struct route_discovery_conn *c = (struct route_discovery_conn *)
-    ((char *)uc - offsetof(struct route_discovery_conn, rreqconn));
-
-	new_msg.hop_limit = msg->hop_limit - 1;
-	new_msg.type = msg->type;
-
-	rt = route_lookup(&msg->unreachable);
-	if(rt != NULL && rimeaddr_cmp(&rt->R_next_addr,from)){
-			route_remove(rt);
-			uint8_t time = 255;
-			route_blacklist_add(&rt->R_dest_addr,time);
-			if(msg->hop_limit>0){
-				send_rerr(c,&new_msg);
-			}
-			return 1;
+	    ((char *)uc - offsetof(struct route_discovery_conn, rrepconn));
+	uint8_t *type = packetbuf_dataptr();
+
+	switch(*type) {
+	case RREP_TYPE:
+		rrep_msg_received(uc, from);
+		break;
+	case RREP_ACK_TYPE:
+		rrep_ack_received(c, from);
+		break;
+	case RERR_TYPE:
+		rerr_msg_process(c, from);
+		break;
+	default:
+		PRINTF("rrep_packet_received: unknown message type %d from %d.%d\n",
+			*type, from->u8[0], from->u8[1]);
+		break;
 	}
-	send_rerr(c,&new_msg);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+static int
+rreq_packet_received(struct netflood_conn *nf, const rimeaddr_t *from,
+		     const rimeaddr_t *originator, uint8_t seqno, uint8_t hops)
+{
+	uint8_t *type = packetbuf_dataptr();
+
+	if(*type == RREQ_MULTI_TYPE) {
+		rreq_multi_received(nf, from);
+	} else {
+		rreq_msg_received(nf, from);
+	}
+	/* RREQs are forwarded by forward_rreq() with updated fields, never
+	   re-flooded unchanged by netflood. */
 	return 0;
 }
 /*------------------------------------------------------------------------------------------------------------------------*/
-static const struct unicast_callbacks rrep_callbacks = {rrep_msg_received};
-static const struct netflood_callbacks rreq_callbacks = {rreq_msg_received, NULL, NULL};
+//Unicast sent callback, feeding the link estimate of the next hop.
+static void
+rrep_packet_sent(struct unicast_conn *uc, int status, int num_tx)
+{
+	link_cost_sent(packetbuf_addr(PACKETBUF_ADDR_RECEIVER), status, num_tx);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+static const struct unicast_callbacks rrep_callbacks = {rrep_packet_received, rrep_packet_sent};
+static const struct netflood_callbacks rreq_callbacks = {rreq_packet_received, NULL, NULL};
 /*------------------------------------------------------------------------------------------------------------------------*/
 void
 route_discovery_open(struct route_discovery_conn *c,
@@ -467,9 +1287,15 @@ route_discovery_open(struct route_discovery_conn *c,
 		     uint16_t channels,
 		     const struct route_discovery_callbacks *callbacks)
 {
+#if JITTER
+  /* The forwarding jitter replaces the netflood queueing delay. */
+  netflood_open(&c->rreqconn, 0, channels + 0, &rreq_callbacks);
+#else /* JITTER */
   netflood_open(&c->rreqconn, time, channels + 0, &rreq_callbacks);
+#endif /* JITTER */
   unicast_open(&c->rrepconn, channels + 1, &rrep_callbacks);
   c->cb = callbacks;
+  link_cost_init();
   PRINTF("route_discovery_open: \n");
 }
 
@@ -477,83 +1303,425 @@ route_discovery_open(struct route_discovery_conn *c,
 void
 route_discovery_close(struct route_discovery_conn *c)
 {
+  struct discovery_entry *d, *next;
+#if ACK_REQUIRED
+  struct rrep_retx_entry *r, *next_r;
+#endif /* ACK_REQUIRED */
+#if JITTER
+  struct rreq_forward_entry *f, *next_f;
+#endif /* JITTER */
+
   unicast_close(&c->rrepconn);
   netflood_close(&c->rreqconn);
-  ctimer_stop(&c->t);
+  for(d = list_head(discovery_list); d != NULL; d = next) {
+    uint8_t i;
+
+    next = list_item_next(d);
+    for(i = 0; i < d->num_waiters && d->waiters[i] != c; i++);
+    if(i == d->num_waiters) {
+      continue;
+    }
+    d->num_waiters--;
+    d->waiters[i] = d->waiters[d->num_waiters];
+    if(d->num_waiters == 0) {
+      discovery_remove(d);
+    } else if(d->c == c) {
+      /* Retries go out on a connection that is still open. */
+      d->c = d->waiters[0];
+      if(d->batch != NULL && d->batch->c == c) {
+        d->batch->c = d->c;
+      }
+    }
+  }
+#if ACK_REQUIRED
+  for(r = list_head(rrep_retx_list); r != NULL; r = next_r) {
+    next_r = list_item_next(r);
+    if(r->c == c) {
+      rrep_retx_remove(r);
+    }
+  }
+#endif /* ACK_REQUIRED */
+#if JITTER
+  for(f = list_head(rreq_forward_list); f != NULL; f = next_f) {
+    next_f = list_item_next(f);
+    if(f->c == c) {
+      ctimer_stop(&f->t);
+      list_remove(rreq_forward_list, f);
+      memb_free(&rreq_forward_mem, f);
+    }
+  }
+#endif /* JITTER */
   PRINTF("route_discovery_close: \n");
 }
 
+/*------------------------------------------------------------------------------------------------------------------------*/
+void rreq_initial(rreq_message *msg,const rimeaddr_t *addr,uint8_t hop_limit){
+
+	msg->type = RREQ_TYPE;
+	msg->metric_type = ROUTE_METRIC;
+	msg->route_metric = 0;
+	msg->seqno = own_seqno;
+	msg->hop_count = 0;
+	msg->weak_links = 0;
+	msg->hop_limit = hop_limit;
+	rimeaddr_copy(&msg->destination,addr);
+	rimeaddr_copy(&msg->originator,&rimeaddr_node_addr);
+	own_seqno++;
+}
+
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Returns the shortest time a RREP can take to come back from a RREQ limited
+//to hop_limit hops.
+static clock_time_t
+ring_wait(uint8_t hop_limit)
+{
+	if(hop_limit > NET_DIAMETER) {
+		hop_limit = NET_DIAMETER;
+	}
+	return (clock_time_t)(hop_limit * HOP_RTT);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Returns the hop_limit of the next RREQ of discovery d.
+static uint8_t
+ring_next(struct discovery_entry *d)
+{
+	uint8_t last_hops;
+
+	if(RING_START == 0 || d->retries >= MAX_RETRIES) {
+		return MAX_HOP_LIMIT;
+	}
+	if(d->retries == 0) {
+		last_hops = route_last_hops(&d->dest);
+		if(last_hops == 0) {
+			return RING_START;
+		}
+		return last_hops + RING_INCREMENT > RING_THRESHOLD ?
+			MAX_HOP_LIMIT : last_hops + RING_INCREMENT;
+	}
+	if(d->ring >= RING_THRESHOLD) {
+		return MAX_HOP_LIMIT;
+	}
+	return d->ring + RING_INCREMENT;
+}
 /*------------------------------------------------------------------------------------------------------------------------*/
 static void
 timeout_handler(void *ptr)
 {
-  struct route_discovery_conn *c = ptr;
-  PRINTF("route_discovery: timeout, timed out\n");
-  rrep_pending = 0;
-  if(c->cb->timedout) {
-    c->cb->timedout(c);
+  struct discovery_entry *d = ptr;
+  rreq_message new_msg;
+  uint8_t ring;
+
+  if(d->retries < MAX_RETRIES) {
+    /* Back off and try again with a fresh sequence number. */
+    d->retries++;
+    ring = ring_next(d);
+    d->wait *= 2;
+    if(d->wait < ring_wait(ring)) {
+      d->wait = ring_wait(ring);
+    }
+    PRINTF("route_discovery: timeout, retry %d of %d for %d.%d\n",
+	   d->retries, MAX_RETRIES, d->dest.u8[0], d->dest.u8[1]);
+    ctimer_set(&d->t, d->wait, timeout_handler, d);
+    /* A retry the rate limiter refuses is lost, but the discovery still
+       ends in time. */
+    if(originate_allowed(&d->dest)) {
+      d->ring = ring;
+      rreq_initial(&new_msg, &d->dest, d->ring);
+      send_rreq(d->c, &new_msg);
+    }
+    return;
   }
+
+  PRINTF("route_discovery: timeout, timed out discovery of %d.%d\n",
+	 d->dest.u8[0], d->dest.u8[1]);
+  /* Only a search of the whole network proves dest unreachable, not a
+     repair limited to a few hops. */
+  if(!d->repair && d->ring == MAX_HOP_LIMIT) {
+    unreachable_add(&d->dest);
+  }
+  discovery_complete(d, 0);
 }
 /*------------------------------------------------------------------------------------------------------------------------*/
-void rreq_initial(rreq_message *msg,const rimeaddr_t *addr){
+//Allocates the entry of a new discovery of addr on connection c, or returns
+//NULL if the table is full. The caller checks that no discovery of addr is
+//in flight and that the rate limiter allows the RREQ.
+static struct discovery_entry *
+discovery_new(struct route_discovery_conn *c, const rimeaddr_t *addr)
+{
+	struct discovery_entry *d;
 
-	msg->type = RREQ_TYPE;
-	msg->metric_type = 0;
-	msg->route_metric = 0;
-	msg->seqno = rreq_seqno;
-	msg->hop_count = 0;
-	msg->hop_limit = MAX_HOP_LIMIT;
-	rimeaddr_copy(&msg->destination,addr);
-	rimeaddr_copy(&msg->originator,&rimeaddr_node_addr);
-	rreq_seqno++;
+	d = memb_alloc(&discovery_mem);
+	if(d == NULL) {
+		PRINTF("route_discovery_send: ignoring request to %d.%d, too many discoveries in flight\n",
+			addr->u8[0], addr->u8[1]);
+		return NULL;
+	}
+	d->c = c;
+	d->repair = 0;
+	d->batch = NULL;
+	d->waiters[0] = c;
+	d->num_waiters = 1;
+	rimeaddr_copy(&d->dest, addr);
+	list_add(discovery_list, d);
+	return d;
 }
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Returns how long the first RREQ of a discovery, limited to hop_limit hops,
+//waits: long enough for its RREP to come back, and if timeout allows it,
+//longer so that all attempts together take about timeout.
+static clock_time_t
+first_wait(clock_time_t timeout, uint8_t hop_limit)
+{
+	clock_time_t wait;
 
+	wait = timeout / ((1 << (MAX_RETRIES + 1)) - 1);
+	return wait < ring_wait(hop_limit) ? ring_wait(hop_limit) : wait;
+}
 /*------------------------------------------------------------------------------------------------------------------------*/
 int
 route_discovery_discover(struct route_discovery_conn *c, const rimeaddr_t *addr,
 			 clock_time_t timeout)
 {
-  if(rrep_pending) {
-    PRINTF("route_discovery_send: ignoring request because of pending response\n");
-    return 0;
-  }
+	struct discovery_entry *d;
 	rreq_message new_msg;
-	rreq_initial(&new_msg,addr);
-	PRINTF("route_discovery_send: sending route request\n");
-	ctimer_set(&c->t, timeout, timeout_handler, c);
-	rrep_pending = 1;
+
+	d = discovery_lookup(addr);
+	if(d != NULL) {
+		/* Already looked for, the RREP will be shared. */
+		PRINTF("route_discovery_send: joining discovery of %d.%d in flight\n",
+			addr->u8[0], addr->u8[1]);
+		if(!discovery_join(d, c)) {
+			return 0;
+		}
+		if(d->repair) {
+			/* A local repair is too small and too short for a source, it
+			   becomes a full discovery whose next RREQ floods the
+			   network. */
+			d->repair = 0;
+			d->retries = 0;
+			d->ring = MAX_HOP_LIMIT;
+			d->wait = first_wait(timeout, d->ring);
+		}
+		return 1;
+	}
+	if(!originate_allowed(addr)) {
+		return 0;
+	}
+	d = discovery_new(c, addr);
+	if(d == NULL) {
+		return 0;
+	}
+	d->retries = 0;
+	d->ring = ring_next(d);
+	d->wait = first_wait(timeout, d->ring);
+
+	rreq_initial(&new_msg,addr,d->ring);
+	PRINTF("route_discovery_send: sending route request, hop limit %d\n", d->ring);
+	ctimer_set(&d->t, d->wait, timeout_handler, d);
 	send_rreq(c, &new_msg);
 	return 1;
 }
 /*------------------------------------------------------------------------------------------------------------------------*/
+//Sends a multi-target RREQ for the destinations of msg, or a plain RREQ if
+//there is only one, and empties the list.
+static void
+send_rreq_multi(struct route_discovery_conn *c, struct rreq_multi_message *msg)
+{
+	if(msg->num_targets == 0) {
+		return;
+	}
+	rreq_initial(&msg->hdr, &msg->targets[0], MAX_HOP_LIMIT);
+	if(msg->num_targets > 1) {
+		msg->hdr.type = RREQ_MULTI_TYPE;
+		rimeaddr_copy(&msg->hdr.destination, &rimeaddr_null);
+	}
+	PRINTF("route_discovery_discover_multi: sending route request for %d destinations\n",
+		msg->num_targets);
+	send_rreq(c, &msg->hdr);
+	msg->num_targets = 0;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Retries the unresolved discoveries of batch b in one multi-target RREQ, or
+//lets them all time out once MAX_RETRIES is reached.
+static void
+batch_timeout(void *ptr)
+{
+	struct discovery_batch *b = ptr;
+	struct rreq_multi_message msg;
+	struct discovery_entry *d;
+
+	if(b->retries < MAX_RETRIES) {
+		b->retries++;
+		b->wait *= 2;
+		ctimer_set(&b->t, b->wait, batch_timeout, b);
+		msg.num_targets = 0;
+		for(d = list_head(discovery_list); d != NULL; d = list_item_next(d)) {
+			if(d->batch == b) {
+				d->retries = b->retries;
+				rimeaddr_copy(&msg.targets[msg.num_targets++], &d->dest);
+			}
+		}
+		PRINTF("route_discovery: timeout, retry %d of %d for %d destinations\n",
+			b->retries, MAX_RETRIES, msg.num_targets);
+		if(msg.num_targets > 0 && originate_allowed(&msg.targets[0])) {
+			send_rreq_multi(b->c, &msg);
+		}
+		return;
+	}
+
+	/* The discoveries end on their own timers, out of the batch, as their
+	   callbacks may start new batches. */
+	for(d = list_head(discovery_list); d != NULL; d = list_item_next(d)) {
+		if(d->batch == b) {
+			d->batch = NULL;
+			d->retries = MAX_RETRIES;
+			ctimer_set(&d->t, 0, timeout_handler, d);
+		}
+	}
+	batch_remove(b);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Allocates a batch for the discoveries of a multi-target RREQ sent on c,
+//waiting wait for their RREPs, or returns NULL if there is none left.
+static struct discovery_batch *
+batch_new(struct route_discovery_conn *c, clock_time_t wait)
+{
+	struct discovery_batch *b;
+
+	b = memb_alloc(&batch_mem);
+	if(b == NULL) {
+		return NULL;
+	}
+	b->c = c;
+	b->wait = wait;
+	b->retries = 0;
+	list_add(batch_list, b);
+	ctimer_set(&b->t, wait, batch_timeout, b);
+	return b;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+int
+route_discovery_discover_multi(struct route_discovery_conn *c,
+			       const rimeaddr_t *dests, uint8_t num,
+			       clock_time_t timeout)
+{
+	struct rreq_multi_message msg;
+	struct discovery_entry *d;
+	struct discovery_batch *b = NULL;
+	uint8_t i, found;
+
+	msg.num_targets = 0;
+	found = 0;
+	for(i = 0; i < num; i++) {
+		d = discovery_lookup(&dests[i]);
+		if(d != NULL) {
+			found += discovery_join(d, c);
+			continue;
+		}
+		/* One token for each RREQ, however many destinations it carries. */
+		if(msg.num_targets == 0 && !originate_allowed(&dests[i])) {
+			break;
+		}
+		d = discovery_new(c, &dests[i]);
+		if(d == NULL) {
+			break;
+		}
+		/* The batch floods the whole network, and is retried as a whole. */
+		d->retries = 0;
+		d->ring = MAX_HOP_LIMIT;
+		d->wait = first_wait(timeout, d->ring);
+		if(msg.num_targets == 0) {
+			b = batch_new(c, d->wait);
+		}
+		d->batch = b;
+		if(b == NULL) {
+			/* No batch left, this discovery is retried on its own. */
+			ctimer_set(&d->t, d->wait, timeout_handler, d);
+		}
+		rimeaddr_copy(&msg.targets[msg.num_targets++], &dests[i]);
+		found++;
+		if(msg.num_targets == ROUTE_DISCOVERY_MAX_TARGETS) {
+			send_rreq_multi(c, &msg);
+		}
+	}
+	send_rreq_multi(c, &msg);
+	return found;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Local repair of a broken route: a single RREQ limited to hop_limit hops,
+//reported like any other discovery through new_route or timedout.
 int
 route_discovery_repairs(struct route_discovery_conn *c, const rimeaddr_t *addr,
-			 clock_time_t timeout)
+			 clock_time_t timeout, uint8_t hop_limit)
 {
+	struct discovery_entry *d;
+	rreq_message new_msg;
 
+	d = discovery_lookup(addr);
+	if(d != NULL) {
+		/* A discovery in flight answers the repair as well. */
+		return discovery_join(d, c);
+	}
+	if(!originate_allowed(addr)) {
+		return 0;
+	}
+	d = discovery_new(c, addr);
+	if(d == NULL) {
+		return 0;
+	}
+	/* No retries: a repair that fails falls back to a RERR. */
+	d->retries = MAX_RETRIES;
+	d->repair = 1;
+	d->wait = timeout;
+	d->ring = hop_limit;
+
+	rreq_initial(&new_msg,addr,d->ring);
+	PRINTF("route_discovery_repairs: repairing route to %d.%d, hop limit %d\n",
+		addr->u8[0], addr->u8[1], d->ring);
+	ctimer_set(&d->t, d->wait, timeout_handler, d);
+	send_rreq(c, &new_msg);
+	return 1;
 }
 /*------------------------------------------------------------------------------------------------------------------------*/
-//generate the err msg
 int
-route_discovery_rerr(struct route_discovery_conn *c, uint8_t Error_Code,const rimeaddr_t *broken_source_addr,
-		const rimeaddr_t *broken_dest_addr)
+route_discovery_unreachable(const rimeaddr_t *dest)
 {
-	//A packet with an RERR message is generated by the LOADng Router,detecting the link breakage
-	struct route_entry *rt;
-	rerr_message *msg;
-	packetbuf_clear();
-	msg = packetbuf_dataptr();
-	packetbuf_set_datalen(sizeof( rerr_message));
-	msg->errorcode = Error_Code;
-	msg->hop_limit = MAX_HOP_LIMIT;
-	rimeaddr_copy(&msg->unreachable,broken_dest_addr);
-	rimeaddr_copy(&msg->destination,broken_source_addr);
-	rimeaddr_copy(&msg->originator,&rimeaddr_node_addr);
+	struct unreachable_entry *e;
 
-	rt = route_lookup(&msg->destination);
-	if(rt != NULL) {
-	    unicast_send(&c->rrepconn, &rt->R_next_addr);
+	e = unreachable_lookup(dest);
+	if(e == NULL) {
+		return 0;
+	}
+	/* A route learnt in the meantime, from a RREQ of dest for instance,
+	   clears the hold-down. */
+	if(route_lookup(dest) != NULL) {
+		unreachable_remove(e);
+		return 0;
 	}
+	return !TIME_REACHED(clock_time(), e->until);
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+const struct route_discovery_stats *
+route_discovery_stats(void)
+{
+	return &stats;
+}
+/*------------------------------------------------------------------------------------------------------------------------*/
+//Generates a RERR for the broken route to unreachable and sends it towards
+//source, the originator of the data that could not be delivered.
+int
+route_discovery_rerr(struct route_discovery_conn *c, uint8_t error_code,
+		const rimeaddr_t *source, const rimeaddr_t *unreachable)
+{
+	//A packet with an RERR message is generated by the LOADng Router,detecting the link breakage
+	rerr_message msg;
+
+	msg.errorcode = error_code;
+	msg.hop_limit = MAX_HOP_LIMIT;
+	rimeaddr_copy(&msg.unreachable, unreachable);
+	rimeaddr_copy(&msg.destination, source);
+	rimeaddr_copy(&msg.originator, &rimeaddr_node_addr);
 
+	return send_rerr(c, &msg);
 }
 
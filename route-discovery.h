@@ -61,6 +61,8 @@
 #define RREP_TYPE 0X1
 #define RREP_ACK_TYPE 0X2
 #define RERR_TYPE 0X3
+/* A RREQ listing several destinations, see route_discovery_discover_multi() */
+#define RREQ_MULTI_TYPE 0X4
 
 
 #ifndef __ROUTE_DISCOVERY_H__
@@ -75,25 +77,79 @@ struct route_discovery_conn;
 struct route_discovery_callbacks {
   void (* new_route)(struct route_discovery_conn *c, const rimeaddr_t *to);
   void (* timedout)(struct route_discovery_conn *c);
+  /* Optional, called instead of timedout when set: to is the destination
+     whose discovery timed out. */
+  void (* timedout_to)(struct route_discovery_conn *c, const rimeaddr_t *to);
 };
 
+/* Maximum number of route discoveries in flight at the same time. */
+#ifdef ROUTE_DISCOVERY_CONF_ENTRIES
+#define ROUTE_DISCOVERY_ENTRIES ROUTE_DISCOVERY_CONF_ENTRIES
+#else /* ROUTE_DISCOVERY_CONF_ENTRIES */
 #define ROUTE_DISCOVERY_ENTRIES 8
+#endif /* ROUTE_DISCOVERY_CONF_ENTRIES */
+
+/* Maximum number of connections sharing the discovery of one destination. */
+#ifdef ROUTE_DISCOVERY_CONF_WAITERS
+#define ROUTE_DISCOVERY_WAITERS ROUTE_DISCOVERY_CONF_WAITERS
+#else /* ROUTE_DISCOVERY_CONF_WAITERS */
+#define ROUTE_DISCOVERY_WAITERS 2
+#endif /* ROUTE_DISCOVERY_CONF_WAITERS */
+
+/* Maximum number of destinations listed in one multi-target RREQ. */
+#ifdef ROUTE_DISCOVERY_CONF_MAX_TARGETS
+#define ROUTE_DISCOVERY_MAX_TARGETS ROUTE_DISCOVERY_CONF_MAX_TARGETS
+#else /* ROUTE_DISCOVERY_CONF_MAX_TARGETS */
+#define ROUTE_DISCOVERY_MAX_TARGETS 8
+#endif /* ROUTE_DISCOVERY_CONF_MAX_TARGETS */
 
 struct route_discovery_conn {
   struct netflood_conn rreqconn;
   struct unicast_conn rrepconn;
-  struct ctimer t;
+  struct ctimer t;	/* not used, each discovery has its own timer */
   const struct route_discovery_callbacks *cb;
 };
 
 void route_discovery_open(struct route_discovery_conn *c, clock_time_t time,
 			  uint16_t channels,
 			  const struct route_discovery_callbacks *callbacks);
+/* Looks for a route to dest. A discovery of dest already in flight, on
+   any connection, is shared rather than started again: its outcome is
+   reported to the callbacks of every connection that asked for it. */
 int route_discovery_discover(struct route_discovery_conn *c, const rimeaddr_t *dest,
 			     clock_time_t timeout);
+/* Looks for routes to the num destinations of dests with a single flooded
+   RREQ per ROUTE_DISCOVERY_MAX_TARGETS of them, each answered by its own
+   RREP. Every destination is then reported on its own, like with
+   route_discovery_discover(). Returns the number of destinations being
+   looked for. */
+int route_discovery_discover_multi(struct route_discovery_conn *c,
+				   const rimeaddr_t *dests, uint8_t num,
+				   clock_time_t timeout);
+int route_discovery_repairs(struct route_discovery_conn *c, const rimeaddr_t *dest,
+			    clock_time_t timeout, uint8_t hop_limit);
 
 void route_discovery_close(struct route_discovery_conn *c);
 
+/* Whether the last discovery of dest failed recently enough that it
+   should not be looked for again yet. */
+int route_discovery_unreachable(const rimeaddr_t *dest);
+
+/* RREQs dropped by the rate limiter since boot. */
+struct route_discovery_stats {
+  uint16_t originate_dropped;	/* discoveries not started */
+  uint16_t forward_dropped;	/* RREQs of other routers not forwarded */
+};
+
+const struct route_discovery_stats *route_discovery_stats(void);
+
+/* Error codes of RERR messages. */
+#define RERR_NO_AVAILABLE_LINK 0
+
+/* Tells source that this router lost its route to unreachable. */
+int route_discovery_rerr(struct route_discovery_conn *c, uint8_t error_code,
+			 const rimeaddr_t *source, const rimeaddr_t *unreachable);
+
 #endif /* __ROUTE_DISCOVERY_H__ */
 /** @} */
 /** @} */
\ No newline at end of file
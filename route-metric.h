@@ -0,0 +1,131 @@
+/**
+ * \addtogroup rimeroute
+ * @{
+ */
+
+/*
+ * Copyright (c) 2014, University of Southern California.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * This file is part of the Contiki operating system.
+ *
+ */
+
+/**
+ * \file
+ *         Compile-time selection of the LOADng routing metric
+ * \author
+ *         {Jiahao Liang, Zhikun Liu, Haimo Bai} @ USC
+ *
+ * ROUTE_CONF_METRIC picks one of the metrics below. Each metric defines
+ *
+ * - ROUTE_METRIC_LINK_COST(neighbor): cost of the link to a neighbor,
+ * - ROUTE_METRIC_ACCUMULATE(path, link): cost of a path grown by one link,
+ * - ROUTE_METRIC_BETTER(a, b) and ROUTE_METRIC_EQUAL(a, b): comparison of
+ *   two struct dist_tuple, weak links first,
+ * - ROUTE_METRIC_WEAK_LINK(neighbor): whether the link to a neighbor is
+ *   a weak link in the LOADng sense.
+ *
+ * Everything is a macro so that the route table and the RREQ/RREP
+ * handlers compile down to the chosen metric.
+ */
+
+#ifndef __ROUTE_METRIC_H__
+#define __ROUTE_METRIC_H__
+
+#include "net/rime/link-cost.h"
+
+//Metric identifiers, stored in R_metric and in the metric_type of RREQs and RREPs.
+#define ROUTE_METRIC_HOP_COUNT 0	//one per link
+#define ROUTE_METRIC_ETX 1	//ETX of the link, see link-cost.h
+#define ROUTE_METRIC_ENERGY 2	//ETX of the link, weighted by our residual energy
+
+#ifdef ROUTE_CONF_METRIC
+#define ROUTE_METRIC ROUTE_CONF_METRIC
+#else /* ROUTE_CONF_METRIC */
+#define ROUTE_METRIC ROUTE_METRIC_ETX
+#endif /* ROUTE_CONF_METRIC */
+
+//Largest route cost, a path that would cost more is capped to it.
+#define ROUTE_METRIC_MAX 0xffff
+
+/*
+ * A link is weak when its ETX, whatever the metric, is above
+ * ROUTE_METRIC_WEAK_ETX (in 1 / LINK_COST_ETX_DIVISOR transmissions).
+ * Weak links are counted along a path up to ROUTE_METRIC_MAX_WEAK_LINKS,
+ * the range of dist_tuple.weak_links.
+ */
+#ifdef ROUTE_METRIC_CONF_WEAK_ETX
+#define ROUTE_METRIC_WEAK_ETX ROUTE_METRIC_CONF_WEAK_ETX
+#else /* ROUTE_METRIC_CONF_WEAK_ETX */
+#define ROUTE_METRIC_WEAK_ETX (3 * LINK_COST_ETX_DIVISOR)
+#endif /* ROUTE_METRIC_CONF_WEAK_ETX */
+#define ROUTE_METRIC_MAX_WEAK_LINKS 15
+#define ROUTE_METRIC_WEAK_LINK(neighbor) \
+	(link_cost_etx(neighbor) > ROUTE_METRIC_WEAK_ETX)
+
+#if ROUTE_METRIC == ROUTE_METRIC_HOP_COUNT
+#define ROUTE_METRIC_LINK_COST(neighbor) 1
+
+#elif ROUTE_METRIC == ROUTE_METRIC_ETX
+#define ROUTE_METRIC_LINK_COST(neighbor) link_cost_etx(neighbor)
+
+#elif ROUTE_METRIC == ROUTE_METRIC_ENERGY
+/*
+ * ROUTE_METRIC_CONF_ENERGY_LEVEL() returns the residual energy of this
+ * router, from 0 (empty) to ROUTE_METRIC_ENERGY_MAX (full). A link costs
+ * its ETX on a full battery and up to twice as much on an empty one, so
+ * routes drift away from routers running low.
+ */
+#define ROUTE_METRIC_ENERGY_MAX 255
+#ifdef ROUTE_METRIC_CONF_ENERGY_LEVEL
+#define ROUTE_METRIC_ENERGY_LEVEL() ROUTE_METRIC_CONF_ENERGY_LEVEL()
+#else /* ROUTE_METRIC_CONF_ENERGY_LEVEL */
+#define ROUTE_METRIC_ENERGY_LEVEL() ROUTE_METRIC_ENERGY_MAX
+#endif /* ROUTE_METRIC_CONF_ENERGY_LEVEL */
+#define ROUTE_METRIC_LINK_COST(neighbor) \
+	((uint16_t)(((uint32_t)link_cost_etx(neighbor) * \
+	(2 * ROUTE_METRIC_ENERGY_MAX - ROUTE_METRIC_ENERGY_LEVEL())) / \
+	ROUTE_METRIC_ENERGY_MAX))
+
+#else
+#error "Unknown ROUTE_CONF_METRIC"
+#endif
+
+#define ROUTE_METRIC_ACCUMULATE(path, link) \
+	((uint32_t)(path) + (link) > ROUTE_METRIC_MAX ? \
+	ROUTE_METRIC_MAX : (uint32_t)(path) + (link))
+
+/* Distances compare as (weak_links, route_cost), lexicographically. */
+#define ROUTE_METRIC_BETTER(a, b) \
+	((a)->weak_links < (b)->weak_links || \
+	((a)->weak_links == (b)->weak_links && (a)->route_cost < (b)->route_cost))
+#define ROUTE_METRIC_EQUAL(a, b) \
+	((a)->weak_links == (b)->weak_links && (a)->route_cost == (b)->route_cost)
+
+#endif /* __ROUTE_METRIC_H__ */
+/** @} */
@@ -43,10 +43,12 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "lib/list.h"
 #include "lib/memb.h"
 #include "sys/ctimer.h"
 #include "net/rime/route.h"
+#include "net/rime/route-metric.h"
 #include "contiki-conf.h"
 #include "net/uip.h"
 
@@ -69,16 +71,75 @@
 
 /*---------------------------------------------------------------------------*/
 /*Parameters and constants*/
+#ifdef ROUTE_CONF_ENTRIES
+#define NUM_RS_ENTRIES ROUTE_CONF_ENTRIES
+#else /* ROUTE_CONF_ENTRIES */
 #define NUM_RS_ENTRIES 8
+#endif /* ROUTE_CONF_ENTRIES */
+/*
+ * Number of slots in the Routing Set hash index. Must be a power of two
+ * and larger than NUM_RS_ENTRIES so that a probe always hits an empty slot.
+ */
+#ifdef ROUTE_CONF_INDEX_SIZE
+#define ROUTE_INDEX_SIZE ROUTE_CONF_INDEX_SIZE
+#else /* ROUTE_CONF_INDEX_SIZE */
+#define ROUTE_INDEX_SIZE 16
+#endif /* ROUTE_CONF_INDEX_SIZE */
+#if (ROUTE_INDEX_SIZE & (ROUTE_INDEX_SIZE - 1)) != 0
+#error "ROUTE_INDEX_SIZE must be a power of two"
+#endif
+#if ROUTE_INDEX_SIZE <= NUM_RS_ENTRIES
+#error "ROUTE_INDEX_SIZE must be larger than NUM_RS_ENTRIES"
+#endif
 #define NUM_BLACKLIST_ENTRIES 2 * NUM_RS_ENTRIES
 #define NUM_pending_ENTRIES NUM_RS_ENTRIES
 #define ROUTE_TIMEOUT 50
+/*
+ * Maximum number of next hops kept per destination. route_lookup()
+ * returns the cheapest one whose next hop is not blacklisted, the others
+ * stand by as alternates.
+ */
+#ifdef ROUTE_CONF_MAX_NEXTHOPS
+#define ROUTE_MAX_NEXTHOPS ROUTE_CONF_MAX_NEXTHOPS
+#else /* ROUTE_CONF_MAX_NEXTHOPS */
+#define ROUTE_MAX_NEXTHOPS 2
+#endif /* ROUTE_CONF_MAX_NEXTHOPS */
+/*
+ * Victim selection when route_set_mem is exhausted. Pinned routes are
+ * never evicted, whatever the policy.
+ */
+#define ROUTE_EVICT_LRU 0	//least recently used route goes first
+#define ROUTE_EVICT_HIGHEST_COST 1	//highest cost route goes first, LRU on ties
+#ifdef ROUTE_CONF_EVICTION
+#define ROUTE_EVICTION ROUTE_CONF_EVICTION
+#else /* ROUTE_CONF_EVICTION */
+#define ROUTE_EVICTION ROUTE_EVICT_LRU
+#endif /* ROUTE_CONF_EVICTION */
 /*
  * not used
  * #define NET_TRAVERSAL_TIME 2
- * #define BLACKLIST_TIME 10
  */
-#define METRICS 0
+/*
+ * Seconds a neighbor stays blacklisted after a RREP-ACK it owed us timed
+ * out. RREQs from a blacklisted neighbor are dropped, as the link towards
+ * it is likely unidirectional.
+ */
+#ifdef ROUTE_CONF_BLACKLIST_TIME
+#define BLACKLIST_TIME ROUTE_CONF_BLACKLIST_TIME
+#else /* ROUTE_CONF_BLACKLIST_TIME */
+#define BLACKLIST_TIME 10
+#endif /* ROUTE_CONF_BLACKLIST_TIME */
+/*
+ * Number of destinations whose last known hop count is remembered after
+ * their routes are gone, to size the next discovery towards them.
+ */
+#ifdef ROUTE_CONF_HISTORY_ENTRIES
+#define NUM_HISTORY_ENTRIES ROUTE_CONF_HISTORY_ENTRIES
+#else /* ROUTE_CONF_HISTORY_ENTRIES */
+#define NUM_HISTORY_ENTRIES 4
+#endif /* ROUTE_CONF_HISTORY_ENTRIES */
+//Slots in the Pending Acknowledgement Set hash index, same rules as ROUTE_INDEX_SIZE.
+#define PENDING_INDEX_SIZE ROUTE_INDEX_SIZE
 /*---------------------------------------------------------------------------*/
 
 #define DEBUG 1
@@ -94,108 +155,368 @@
  */
 LIST(route_set);
 MEMB(route_set_mem, struct route_entry, NUM_RS_ENTRIES);
+/*
+ * Hash index of the Routing Set, keyed on R_dest_addr. Open addressing
+ * with linear probing: all tuples towards the same destination sit in
+ * the same cluster, so a lookup stops at the first empty slot.
+ */
+static struct route_entry *route_index[ROUTE_INDEX_SIZE];
 /*
  * List of Blacklisted Neighbor Set
  */
 LIST(blacklist_set);
 MEMB(blacklist_set_mem, struct blacklist_tuple, NUM_BLACKLIST_ENTRIES);
 /*
- * List of Pending Acknowledgement Set
+ * List of Pending Acknowledgement Set, ordered by P_ack_timeout so that
+ * the next entry to time out is always at the head.
  */
 LIST(pending_set);
 MEMB(pending_set_mem, struct pending_entry, NUM_pending_ENTRIES);
+/*
+ * Hash index of the Pending Acknowledgement Set, keyed on
+ * (P_next_hop, P_originator, P_seq_num).
+ */
+static struct pending_entry *pending_index[PENDING_INDEX_SIZE];
 
+/*
+ * Tuples carry absolute deadlines. A single timer is armed for the
+ * earliest one, so an idle node does not wake up to age its tables.
+ */
 static struct ctimer t;
+static clock_time_t next_expiry;
+static uint8_t timer_armed;
 
 static int max_route_time = ROUTE_TIMEOUT;
 
+/* Number of tuples currently allocated in the Routing Set. */
+static int num_routes;
+
+/*
+ * Cursor of route_get(): the last entry returned and its position, so
+ * that walking the table by increasing index does not restart from the
+ * head each time. Reset whenever route_set changes.
+ */
+static struct route_entry *get_cursor;
+static int get_cursor_num;
+
+/*
+ * Hop counts of removed routes. Slots are reused round-robin, a
+ * destination already present is overwritten in place.
+ */
+static struct {
+	rimeaddr_t dest;
+	uint8_t hops;	//0 marks an unused slot
+} history[NUM_HISTORY_ENTRIES];
+static uint8_t history_next;
+
+/* Wrap-around safe check whether clock time a has reached clock time b. */
+#define TIME_HALF_RANGE ((clock_time_t)~(clock_time_t)0 >> 1)
+#define TIME_REACHED(a, b) ((clock_time_t)((a) - (b)) <= TIME_HALF_RANGE)
+
+static void expire(void *ptr);
+
 /*---------------------------------------------------------------------------*/
-//Periodically remove entries in Routing Set
+//Hashes a destination address into a slot of the route index.
+static uint16_t
+route_hash(const rimeaddr_t *addr)
+{
+  uint16_t h;
+  int i;
+
+  h = 0;
+  for(i = 0; i < RIMEADDR_SIZE; i++) {
+    h = (h << 5) - h + addr->u8[i];
+  }
+  return h & (ROUTE_INDEX_SIZE - 1);
+}
+/*---------------------------------------------------------------------------*/
+//Inserts a route entry into the route index.
 static void
-periodic(void *ptr)
+route_index_add(struct route_entry *e)
 {
-  struct route_entry *e;
-  struct blacklist_tuple *b;
-  struct pending_entry *p;
+  uint16_t i;
 
-  for(e = list_head(route_set); e != NULL; e = list_item_next(e)) {
-    ++(e->R_valid_time);
-    if(e->R_valid_time >= max_route_time) {
-      PRINTF("route periodic: removing entry to %d.%d with nexthop %d.%d and metric type:%d cost: %d weak links: %d\n",
+  for(i = route_hash(&e->R_dest_addr); route_index[i] != NULL;
+      i = (i + 1) & (ROUTE_INDEX_SIZE - 1));
+  route_index[i] = e;
+}
+/*---------------------------------------------------------------------------*/
+//Removes a route entry from the route index. The rest of the cluster is
+//shifted back so that no tombstones are needed.
+static void
+route_index_remove(struct route_entry *e)
+{
+  uint16_t i, j, k;
+
+  for(i = route_hash(&e->R_dest_addr); route_index[i] != e;
+      i = (i + 1) & (ROUTE_INDEX_SIZE - 1)) {
+    if(route_index[i] == NULL) {
+      return;
+    }
+  }
+
+  for(j = (i + 1) & (ROUTE_INDEX_SIZE - 1); route_index[j] != NULL;
+      j = (j + 1) & (ROUTE_INDEX_SIZE - 1)) {
+    k = route_hash(&route_index[j]->R_dest_addr);
+    /* Leave the entry where it is if its home slot lies cyclically in (i, j]. */
+    if((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+    route_index[i] = route_index[j];
+    i = j;
+  }
+  route_index[i] = NULL;
+}
+/*---------------------------------------------------------------------------*/
+//Hashes a (next hop, originator, sequence number) key into a slot of the
+//pending index.
+static uint16_t
+pending_hash(const rimeaddr_t *nexthop, const rimeaddr_t *orig, uint16_t seq_num)
+{
+  uint16_t h;
+  int i;
+
+  h = seq_num;
+  for(i = 0; i < RIMEADDR_SIZE; i++) {
+    h = (h << 5) - h + nexthop->u8[i];
+  }
+  for(i = 0; i < RIMEADDR_SIZE; i++) {
+    h = (h << 5) - h + orig->u8[i];
+  }
+  return h & (PENDING_INDEX_SIZE - 1);
+}
+/*---------------------------------------------------------------------------*/
+//Inserts a pending entry into the pending index.
+static void
+pending_index_add(struct pending_entry *e)
+{
+  uint16_t i;
+
+  for(i = pending_hash(&e->P_next_hop, &e->P_originator, e->P_seq_num);
+      pending_index[i] != NULL;
+      i = (i + 1) & (PENDING_INDEX_SIZE - 1));
+  pending_index[i] = e;
+}
+/*---------------------------------------------------------------------------*/
+//Removes a pending entry from the pending index, see route_index_remove().
+static void
+pending_index_remove(struct pending_entry *e)
+{
+  uint16_t i, j, k;
+
+  for(i = pending_hash(&e->P_next_hop, &e->P_originator, e->P_seq_num);
+      pending_index[i] != e;
+      i = (i + 1) & (PENDING_INDEX_SIZE - 1)) {
+    if(pending_index[i] == NULL) {
+      return;
+    }
+  }
+
+  for(j = (i + 1) & (PENDING_INDEX_SIZE - 1); pending_index[j] != NULL;
+      j = (j + 1) & (PENDING_INDEX_SIZE - 1)) {
+    k = pending_hash(&pending_index[j]->P_next_hop,
+                     &pending_index[j]->P_originator,
+                     pending_index[j]->P_seq_num);
+    if((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+    pending_index[i] = pending_index[j];
+    i = j;
+  }
+  pending_index[i] = NULL;
+}
+/*---------------------------------------------------------------------------*/
+//Inserts a pending entry into pending_set, keeping it ordered by deadline.
+static void
+pending_insert_ordered(struct pending_entry *e)
+{
+  struct pending_entry *prev, *p;
+
+  prev = NULL;
+  for(p = list_head(pending_set); p != NULL; p = list_item_next(p)) {
+    if(!TIME_REACHED(e->P_ack_timeout, p->P_ack_timeout)) {
+      break;
+    }
+    prev = p;
+  }
+  list_insert(pending_set, prev, e);
+}
+/*---------------------------------------------------------------------------*/
+//Arms the aging timer for deadline, unless it already fires earlier.
+static void
+schedule_expiry(clock_time_t deadline)
+{
+  clock_time_t now;
+
+  if(timer_armed && TIME_REACHED(deadline, next_expiry)) {
+    return;
+  }
+  now = clock_time();
+  next_expiry = deadline;
+  timer_armed = 1;
+  ctimer_set(&t, TIME_REACHED(now, deadline) ? 0 : (clock_time_t)(deadline - now),
+             expire, NULL);
+}
+/*---------------------------------------------------------------------------*/
+//Removes the tuples whose deadline has passed and re-arms the timer for
+//the earliest deadline left. Refreshed tuples only push their deadline
+//back, so the timer may fire early and find nothing to remove.
+static void
+expire(void *ptr)
+{
+  struct route_entry *e, *next_e;
+  struct blacklist_tuple *b, *next_b;
+  struct pending_entry *p;
+  clock_time_t now, earliest;
+  uint8_t pending;
+
+  now = clock_time();
+  timer_armed = 0;
+  pending = 0;
+  earliest = now;
+
+  for(e = list_head(route_set); e != NULL; e = next_e) {
+    next_e = list_item_next(e);
+    if(TIME_REACHED(now, e->R_valid_time)) {
+      PRINTF("route expire: removing entry to %d.%d with nexthop %d.%d and metric type:%d cost: %d weak links: %d\n",
 	     e->R_dest_addr.u8[0], e->R_dest_addr.u8[1],
 	     e->R_next_addr.u8[0], e->R_next_addr.u8[1],
 	     e->R_metric, (e->R_dist).route_cost, (e->R_dist).weak_links);
       route_remove(e);
+    } else if(!pending || TIME_REACHED(earliest, e->R_valid_time)) {
+      earliest = e->R_valid_time;
+      pending = 1;
     }
   }
-  e = NULL;
 
-  //periodically remove entries in blacklist set while time out
-  for(b = list_head(blacklist_set); b != NULL; b = list_item_next(b)) {
-    --(b->B_valid_time);
-    if(b->B_valid_time == 0) {
-      PRINTF("route periodic: removing blacklisted neighbor %d.%d\n",
+  //remove entries in blacklist set while time out
+  for(b = list_head(blacklist_set); b != NULL; b = next_b) {
+    next_b = list_item_next(b);
+    if(TIME_REACHED(now, b->B_valid_time)) {
+      PRINTF("route expire: removing blacklisted neighbor %d.%d\n",
 		 b->B_neighbor_address.u8[0], b->B_neighbor_address.u8[1]);
       blacklist_remove(b);
+    } else if(!pending || TIME_REACHED(earliest, b->B_valid_time)) {
+      earliest = b->B_valid_time;
+      pending = 1;
     }
   }
-  b = NULL;
 
-  //periodically add entries in pending set  to blacklist set while time out
-  for(p = list_head(pending_set); p != NULL; p = list_item_next(p)) {
-    --(p->P_ack_timeout);
-    if(p->P_ack_timeout == 0) {
-      PRINTF("route periodic: removing entry to %d.%d with nexthop %d.%d and seq_num %d\n",
-				p->P_originator.u8[0], p->P_originator.u8[1],
-				p->P_next_hop.u8[0], p->P_next_hop.u8[1],
-				p->P_seq_num);
-      pending_remove(p);
+  //move timed out entries of the pending set to the blacklist set; the set
+  //is ordered by deadline, so stop at the first one still waiting
+  while((p = list_head(pending_set)) != NULL &&
+        TIME_REACHED(now, p->P_ack_timeout)) {
+    pending_expire(p);
+  }
+  if(p != NULL && (!pending || TIME_REACHED(earliest, p->P_ack_timeout))) {
+    earliest = p->P_ack_timeout;
+    pending = 1;
+  }
+
+  if(pending) {
+    schedule_expiry(earliest);
+  }
+}
+/*---------------------------------------------------------------------------*/
+//Picks the route to evict according to ROUTE_EVICTION. Returns NULL if
+//every route is pinned.
+static struct route_entry *
+route_evict_candidate(void)
+{
+  struct route_entry *e, *victim;
+
+  victim = NULL;
+  for(e = list_head(route_set); e != NULL; e = list_item_next(e)) {
+    if(e->R_pinned) {
+      continue;
+    }
+    if(victim == NULL) {
+      victim = e;
+      continue;
+    }
+#if ROUTE_EVICTION == ROUTE_EVICT_HIGHEST_COST
+    if(!ROUTE_METRIC_EQUAL(&e->R_dist, &victim->R_dist)) {
+      if(ROUTE_METRIC_BETTER(&victim->R_dist, &e->R_dist)) {
+        victim = e;
+      }
+      continue;
+    }
+#endif /* ROUTE_EVICTION == ROUTE_EVICT_HIGHEST_COST */
+    /* On ties, the entry further down the list was added earlier. */
+    if(TIME_REACHED(victim->R_last_used, e->R_last_used)) {
+      victim = e;
     }
   }
-  p = NULL;
+  return victim;
+}
+/*---------------------------------------------------------------------------*/
+//Checks whether a neighbor is in the Blacklisted Neighbor Set, without the
+//tracing done by route_blacklist_lookup().
+static int
+blacklisted(const rimeaddr_t *addr, clock_time_t now)
+{
+  struct blacklist_tuple *b;
 
-  ctimer_set(&t, CLOCK_SECOND, periodic, NULL);
+  for(b = list_head(blacklist_set); b != NULL; b = list_item_next(b)) {
+    if(rimeaddr_cmp(addr, &b->B_neighbor_address)) {
+      return !TIME_REACHED(now, b->B_valid_time);
+    }
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+//Checks whether a route entry towards dest can be used for forwarding.
+static int
+route_usable(struct route_entry *e, const rimeaddr_t *dest, clock_time_t now)
+{
+  return rimeaddr_cmp(dest, &e->R_dest_addr) &&
+    !TIME_REACHED(now, e->R_valid_time) &&
+    !blacklisted(&e->R_next_addr, now);
 }
 /*---------------------------------------------------------------------------*/
 //Allocates and initializes route tables.
 void
 route_init(void)
 {
-	  list_init(route_set);
-	  memb_init(&route_set_mem);
+	  route_flush_all();
 
 	  list_init(blacklist_set);
 	  memb_init(&blacklist_set_mem);
 
 	  list_init(pending_set);
 	  memb_init(&pending_set_mem);
+	  memset(pending_index, 0, sizeof(pending_index));
 
-	  ctimer_set(&t, CLOCK_SECOND, periodic, NULL);
+	  ctimer_stop(&t);
+	  timer_armed = 0;
+
+	  memset(history, 0, sizeof(history));
+	  history_next = 0;
 
 	  PRINTF("route_init: done\n");
 }
 
 /*---------------------------------------------------------------------------*/
-//Looks for a Routing Tuple in the Routing Set.
+//Looks for a Routing Tuple in the Routing Set. Among the alternates towards
+//dest, the cheapest one whose next hop is not blacklisted is returned.
 struct route_entry *
 route_lookup(const rimeaddr_t *dest)
 {
 	struct route_entry *e;
-	uint8_t lowest_cost;
 	struct route_entry *best_entry;
+	uint16_t i;
+	clock_time_t now;
 
-	lowest_cost = -1;	//lowest_cost is an unsigned int, -1 means the largest number
+	now = clock_time();
 	best_entry = NULL;
 
-	/* Find the route with the lowest cost. */
-	for(e = list_head(route_set); e != NULL; e = list_item_next(e)) {
-	/*    printf("route_lookup: comparing %d.%d.%d.%d with %d.%d.%d.%d\n",
-	   uip_ipaddr_to_quad(dest), uip_ipaddr_to_quad(&e->dest));*/
-
-		if(rimeaddr_cmp(dest, &e->R_dest_addr)) {
-		  if((e->R_dist).route_cost < lowest_cost) {
+	/* Find the route with the lowest cost within the destination's cluster. */
+	for(i = route_hash(dest); route_index[i] != NULL;
+			i = (i + 1) & (ROUTE_INDEX_SIZE - 1)) {
+		e = route_index[i];
+		if(route_usable(e, dest, now)) {
+		  if(best_entry == NULL || ROUTE_METRIC_BETTER(&e->R_dist, &best_entry->R_dist)) {
 			best_entry = e;
-			lowest_cost = (e->R_dist).route_cost;
 		  }
 		}
 	}
@@ -213,6 +534,78 @@ route_lookup(const rimeaddr_t *dest)
 
 }
 
+/*---------------------------------------------------------------------------*/
+//Looks for the Routing Tuple towards dest through nexthop, whether it is
+//usable or not.
+struct route_entry *
+route_lookup_via(const rimeaddr_t *dest, const rimeaddr_t *nexthop)
+{
+	struct route_entry *e;
+	uint16_t i;
+
+	for(i = route_hash(dest); route_index[i] != NULL;
+			i = (i + 1) & (ROUTE_INDEX_SIZE - 1)) {
+		e = route_index[i];
+		if(rimeaddr_cmp(dest, &e->R_dest_addr) &&
+				rimeaddr_cmp(nexthop, &e->R_next_addr)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+/*---------------------------------------------------------------------------*/
+//Looks for a Routing Tuple like route_lookup(), but spreads successive calls
+//round-robin over the alternates that share the lowest cost.
+struct route_entry *
+route_lookup_balanced(const rimeaddr_t *dest)
+{
+	struct route_entry *e;
+	struct route_entry *best_entry;
+	struct route_entry *first;
+	struct route_entry *pick;
+	uint16_t i;
+	clock_time_t now;
+
+	best_entry = route_lookup(dest);
+	if(best_entry == NULL) {
+		return NULL;
+	}
+
+	now = clock_time();
+	first = NULL;
+	pick = NULL;
+	for(i = route_hash(dest); route_index[i] != NULL;
+			i = (i + 1) & (ROUTE_INDEX_SIZE - 1)) {
+		e = route_index[i];
+		if(route_usable(e, dest, now) &&
+				ROUTE_METRIC_EQUAL(&e->R_dist, &best_entry->R_dist)) {
+			if(first == NULL) {
+				first = e;
+			}
+			if(pick == NULL && !e->R_rr_used) {
+				pick = e;
+			}
+		}
+	}
+
+	if(pick == NULL) {
+		/* Every equal-cost alternate had its turn, start a new round. */
+		for(i = route_hash(dest); route_index[i] != NULL;
+				i = (i + 1) & (ROUTE_INDEX_SIZE - 1)) {
+			if(rimeaddr_cmp(dest, &route_index[i]->R_dest_addr)) {
+				route_index[i]->R_rr_used = 0;
+			}
+		}
+		pick = first;
+	}
+	pick->R_rr_used = 1;
+
+	PRINTF("route_lookup_balanced: using nexthop %d.%d to %d.%d\n",
+			pick->R_next_addr.u8[0], pick->R_next_addr.u8[1],
+			pick->R_dest_addr.u8[0], pick->R_dest_addr.u8[1]);
+	return pick;
+}
+
 /*---------------------------------------------------------------------------*/
 //Adds a route entry to the Routing Table.
 struct routing_entry *
@@ -220,34 +613,92 @@ route_add(const rimeaddr_t *dest, const rimeaddr_t *nexthop,
 		struct dist_tuple *dist, uint16_t seqno)
 {
 	struct route_entry *e;
+	struct route_entry *a;
+	struct route_entry *worst;
+	uint8_t alternates;
+	uint16_t i;
+	clock_time_t now;
+
+	/* Look for this next hop among the alternates towards dest. */
+	now = clock_time();
+	e = NULL;
+	worst = NULL;
+	alternates = 0;
+	for(i = route_hash(dest); route_index[i] != NULL;
+			i = (i + 1) & (ROUTE_INDEX_SIZE - 1)) {
+		a = route_index[i];
+		if(!rimeaddr_cmp(dest, &a->R_dest_addr)) {
+			continue;
+		}
+		if(rimeaddr_cmp(&a->R_next_addr, nexthop)) {
+			e = a;
+			break;
+		}
+		alternates++;
+		/* Expired alternates are replaced first, then the most expensive. */
+		if(worst == NULL || TIME_REACHED(now, a->R_valid_time) ||
+				(!TIME_REACHED(now, worst->R_valid_time) &&
+				 !ROUTE_METRIC_BETTER(&a->R_dist, &worst->R_dist))) {
+			worst = a;
+		}
+	}
 
-	/* Avoid inserting duplicate entries. */
-	e = route_lookup(dest);
-	if(e != NULL && rimeaddr_cmp(&e->R_next_addr, nexthop)) {
+	if(e != NULL) {
+		/* Avoid inserting duplicate entries. */
 		list_remove(route_set, e);
+	} else if(alternates >= ROUTE_MAX_NEXTHOPS) {
+		if(!TIME_REACHED(now, worst->R_valid_time) &&
+				ROUTE_METRIC_BETTER(&worst->R_dist, dist)) {
+			PRINTF("route_add: %d alternates to %d.%d are all cheaper than nexthop %d.%d\n",
+				 alternates, (*dest).u8[0], (*dest).u8[1],
+				 (*nexthop).u8[0], (*nexthop).u8[1]);
+			return NULL;
+		}
+		/* Replace the worst alternate, its destination stays the same. */
+		e = worst;
+		list_remove(route_set, e);
+		e->R_pinned = 0;
+		e->R_rr_used = 0;
 	} else {
 		/* Allocate a new entry or reuse the oldest entry with highest cost. */
 		e = memb_alloc(&route_set_mem);
-		if(e == NULL) {
-		  /* Remove oldest entry.  XXX */
-		  e = list_chop(route_set);
+		if(e != NULL) {
+		  num_routes++;
+		} else {
+		  /* Evict a route according to the eviction policy. */
+		  e = route_evict_candidate();
+		  if(e == NULL) {
+			  PRINTF("route_add: table full of pinned routes, dropping entry to %d.%d\n",
+				 (*dest).u8[0], (*dest).u8[1]);
+			  return NULL;
+		  }
+		  list_remove(route_set, e);
+		  route_index_remove(e);
 		  PRINTF("route_add: removing entry to %d.%d with nexthop %d.%d and metric type:%d cost: %d weak links: %d\n",
 			 e->R_dest_addr.u8[0], e->R_dest_addr.u8[1],
 			 e->R_next_addr.u8[0], e->R_next_addr.u8[1],
 			 e->R_metric, (e->R_dist).route_cost, (e->R_dist).weak_links);
 		}
+		rimeaddr_copy(&e->R_dest_addr, dest);
+		route_index_add(e);
+		e->R_pinned = 0;
+		e->R_rr_used = 0;
+		e->padding = 0;
 	}
 
-	rimeaddr_copy(&e->R_dest_addr, dest);
 	rimeaddr_copy(&e->R_next_addr, nexthop);
 	e->R_dist.route_cost = dist->route_cost;
 	e->R_dist.weak_links = dist->weak_links;
+	e->R_dist.hops = dist->hops;
 	e->R_seq_num = seqno;
-	e->R_valid_time = 0;
-	e->R_metric = METRICS;
+	e->R_valid_time = now + (clock_time_t)max_route_time * CLOCK_SECOND;
+	e->R_last_used = now;
+	e->R_metric = ROUTE_METRIC;
+	schedule_expiry(e->R_valid_time);
 
 	/* New entry goes first. */
 	list_push(route_set, e);
+	get_cursor = NULL;
 
 	PRINTF("route_add: new entry to %d.%d with nexthop %d.%d and metric type:%d cost: %d weak links: %d\n",
 		 e->R_dest_addr.u8[0], e->R_dest_addr.u8[1],
@@ -257,6 +708,51 @@ route_add(const rimeaddr_t *dest, const rimeaddr_t *nexthop,
 	return (struct routing_entry*)e;
 }
 
+/*---------------------------------------------------------------------------*/
+//Updates a route entry in place with a fresher or cheaper path towards the
+//same destination. Alternates that now duplicate the next hop or carry a
+//different (older) sequence number are removed.
+void
+route_update(struct route_entry *e, const rimeaddr_t *nexthop,
+		struct dist_tuple *dist, uint16_t seqno)
+{
+	struct route_entry *a;
+	uint16_t i;
+	clock_time_t now;
+
+	if(e == NULL) {
+		return;
+	}
+
+	/* route_remove() shifts the cluster back, so slot i is checked again. */
+	i = route_hash(&e->R_dest_addr);
+	while(route_index[i] != NULL) {
+		a = route_index[i];
+		if(a != e && rimeaddr_cmp(&a->R_dest_addr, &e->R_dest_addr) &&
+				(rimeaddr_cmp(&a->R_next_addr, nexthop) || a->R_seq_num != seqno)) {
+			route_remove(a);
+			continue;
+		}
+		i = (i + 1) & (ROUTE_INDEX_SIZE - 1);
+	}
+
+	now = clock_time();
+	rimeaddr_copy(&e->R_next_addr, nexthop);
+	e->R_dist.route_cost = dist->route_cost;
+	e->R_dist.weak_links = dist->weak_links;
+	e->R_dist.hops = dist->hops;
+	e->R_seq_num = seqno;
+	e->R_valid_time = now + (clock_time_t)max_route_time * CLOCK_SECOND;
+	e->R_last_used = now;
+	e->R_rr_used = 0;
+	schedule_expiry(e->R_valid_time);
+
+	PRINTF("route_update: entry to %d.%d with nexthop %d.%d and metric type:%d cost: %d weak links: %d seq_num %d\n",
+		 e->R_dest_addr.u8[0], e->R_dest_addr.u8[1],
+		 e->R_next_addr.u8[0], e->R_next_addr.u8[1],
+		 e->R_metric, e->R_dist.route_cost, e->R_dist.weak_links, e->R_seq_num);
+}
+
 /*---------------------------------------------------------------------------*/
 //Looks for an entry in the Pending List.
 struct pending_entry *
@@ -264,9 +760,12 @@ route_pending_list_lookup (const rimeaddr_t *from,
 		const rimeaddr_t *orig, uint16_t seq_num)
 {
 	struct pending_entry *e;
+	uint16_t i;
 
-	/* Find the pending entry*/
-	for(e = list_head(route_set); e != NULL; e = list_item_next(e)) {
+	/* Find the pending entry through the index. */
+	for(i = pending_hash(from, orig, seq_num); pending_index[i] != NULL;
+			i = (i + 1) & (PENDING_INDEX_SIZE - 1)) {
+		e = pending_index[i];
 		if (rimeaddr_cmp(&e->P_next_hop, from) &&
 				rimeaddr_cmp(&e->P_originator, orig) &&
 				e->P_seq_num == seq_num) {
@@ -300,33 +799,34 @@ struct pending_entry *
 route_pending_add(const rimeaddr_t *nexthop,
 		const rimeaddr_t *dest, uint16_t RREQ_ID, clock_time_t timeout)
 {
-	/*TODO: Do we need to add the tuple to blacklist immediately?? Not added now*/
+	/*The next hop is only blacklisted once the timeout passes without a RREP-ACK.*/
 	struct pending_entry *e;
 
 	/* Avoid inserting duplicate entries. */
 	e = route_pending_list_lookup(nexthop, dest, RREQ_ID);
-	if(e != NULL && rimeaddr_cmp(&e->P_next_hop, nexthop)) {
+	if(e != NULL) {
 		list_remove(pending_set, e);
 	} else {
-		/* Allocate a new entry or reuse the oldest entry with highest cost. */
+		/* Allocate a new entry or reuse the one closest to timing out. */
 		e = memb_alloc(&pending_set_mem);
 		if(e == NULL) {
-		  /* Remove oldest entry.  XXX */
-		  e = list_chop(pending_set);
+		  e = list_pop(pending_set);
+		  pending_index_remove(e);
 		  PRINTF("pending_add: removing entry to %d.%d with nexthop %d.%d and seq_num %d\n",
 			 e->P_originator.u8[0], e->P_originator.u8[1],
 			 e->P_next_hop.u8[0], e->P_next_hop.u8[1],
 			 e->P_seq_num);
 		}
+		rimeaddr_copy(&e->P_originator, dest);
+		rimeaddr_copy(&e->P_next_hop, nexthop);
+		e->P_seq_num = RREQ_ID;
+		pending_index_add(e);
 	}
 
-	rimeaddr_copy(&e->P_originator, dest);
-	rimeaddr_copy(&e->P_next_hop, nexthop);
-	e->P_seq_num = RREQ_ID;
-	e->P_ack_timeout = timeout;
+	e->P_ack_timeout = clock_time() + timeout;
+	schedule_expiry(e->P_ack_timeout);
 
-	/* New entry goes first. */
-	list_push(pending_set, e);
+	pending_insert_ordered(e);
 
 	PRINTF("pending_add: new entry to %d.%d with nexthop %d.%d and seq_num %d\n",
 		 e->P_originator.u8[0], e->P_originator.u8[1],
@@ -350,6 +850,11 @@ route_blacklist_lookup(const rimeaddr_t *addr )
 	   uip_ipaddr_to_quad(dest), uip_ipaddr_to_quad(&e->dest));*/
 
 		if(rimeaddr_cmp(addr, &e->B_neighbor_address)) {
+			if(TIME_REACHED(clock_time(), e->B_valid_time)) {
+				/* Expired, but the aging timer has not run yet. */
+				blacklist_remove(e);
+				break;
+			}
 			PRINTF("blacklist_lookup: found blacklisted neighbor %d.%d\n",
 					e->B_neighbor_address.u8[0], e->B_neighbor_address.u8[1]);
 
@@ -386,7 +891,8 @@ route_blacklist_add(const rimeaddr_t *neighbor, clock_time_t timeout ){
 	}
 
 	rimeaddr_copy(&e->B_neighbor_address, neighbor);
-	e->B_valid_time = timeout;
+	e->B_valid_time = clock_time() + timeout;
+	schedule_expiry(e->B_valid_time);
 
 	/* New entry goes first. */
 	list_push(blacklist_set, e);
@@ -406,7 +912,8 @@ route_refresh(struct route_entry *e)
 	  if(e != NULL) {
 	    /* Refresh age of route so that used routes do not get thrown
 	       out. */
-	    e->R_valid_time = 0;
+	    e->R_valid_time = clock_time() + (clock_time_t)max_route_time * CLOCK_SECOND;
+	    e->R_last_used = clock_time();
 
 	    PRINTF("route_refresh: time %ld for entry to %d.%d with nexthop %d.%d and metric type:%d cost: %d weak links: %d\n",
 	           e->R_valid_time,
@@ -419,23 +926,100 @@ route_refresh(struct route_entry *e)
 	  }
 }
 /*---------------------------------------------------------------------------*/
+//Marks a route entry as used for forwarding. Unlike route_refresh(), this
+//does not extend the validity of the route, it only keeps it from being
+//evicted.
+void
+route_use(struct route_entry *e)
+{
+	if(e != NULL) {
+		e->R_last_used = clock_time();
+	}
+}
+/*---------------------------------------------------------------------------*/
+//Pins or unpins a route entry. Pinned entries are never evicted by route_add.
+void
+route_pin(struct route_entry *e, int pinned)
+{
+	if(e != NULL) {
+		e->R_pinned = pinned ? 1 : 0;
+		PRINTF("route_pin: entry to %d.%d %s\n",
+			e->R_dest_addr.u8[0], e->R_dest_addr.u8[1],
+			pinned ? "pinned" : "unpinned");
+	}
+}
+/*---------------------------------------------------------------------------*/
+//Remembers the hop count of a route about to be removed.
+static void
+history_record(struct route_entry *e)
+{
+	uint8_t i;
+
+	if(e->R_dist.hops == 0) {
+		return;
+	}
+	for(i = 0; i < NUM_HISTORY_ENTRIES; i++) {
+		if(history[i].hops != 0 && rimeaddr_cmp(&history[i].dest, &e->R_dest_addr)) {
+			history[i].hops = e->R_dist.hops;
+			return;
+		}
+	}
+	rimeaddr_copy(&history[history_next].dest, &e->R_dest_addr);
+	history[history_next].hops = e->R_dist.hops;
+	history_next = (history_next + 1) % NUM_HISTORY_ENTRIES;
+}
+/*---------------------------------------------------------------------------*/
+//Returns the hop count of the last route towards dest that was removed from
+//the Routing Set, or 0 if none is remembered.
+uint8_t
+route_last_hops(const rimeaddr_t *dest)
+{
+	uint8_t i;
+
+	for(i = 0; i < NUM_HISTORY_ENTRIES; i++) {
+		if(history[i].hops != 0 && rimeaddr_cmp(&history[i].dest, dest)) {
+			return history[i].hops;
+		}
+	}
+	return 0;
+}
+/*---------------------------------------------------------------------------*/
 //Removes a route entry in the Routing Set.
 void
 route_remove(struct route_entry *e)
 {
 	if (e != NULL) {
+		  history_record(e);
 		  PRINTF("route_remove: removing entry to %d.%d with nexthop %d.%d and metric type:%d cost: %d weak links: %d\n",
 			 e->R_dest_addr.u8[0], e->R_dest_addr.u8[1],
 			 e->R_next_addr.u8[0], e->R_next_addr.u8[1],
 			 e->R_metric, (e->R_dist).route_cost, (e->R_dist).weak_links);
 		  list_remove(route_set, e);
+		  route_index_remove(e);
 		  memb_free(&route_set_mem, e);
+		  num_routes--;
+		  get_cursor = NULL;
 	}
 }
 
 
 /*TODO: do we need to add a pending_remove() & blacklist_remove()?? And make it public??*/
 /*---------------------------------------------------------------------------*/
+//Gives up on the RREP-ACK awaited by e: blacklists its next hop and removes
+//it from the pending_set.
+void
+pending_expire(struct pending_entry *e)
+{
+	if(e != NULL) {
+		PRINTF("pending_expire: no RREP-ACK from %d.%d for entry to %d.%d with seq_num %d\n",
+				e->P_next_hop.u8[0], e->P_next_hop.u8[1],
+				e->P_originator.u8[0], e->P_originator.u8[1],
+				e->P_seq_num);
+		route_blacklist_add(&e->P_next_hop, (clock_time_t)BLACKLIST_TIME * CLOCK_SECOND);
+		pending_remove(e);
+	}
+}
+/*---------------------------------------------------------------------------*/
 //Removes a pending_entry in the pending_set.
 void
 pending_remove(struct pending_entry *e)
@@ -446,6 +1030,7 @@ pending_remove(struct pending_entry *e)
 				e->P_next_hop.u8[0], e->P_next_hop.u8[1],
 				e->P_seq_num);
 		list_remove(pending_set, e);
+		pending_index_remove(e);
 		memb_free(&pending_set_mem, e);
 	}
 }
@@ -471,32 +1056,81 @@ route_decay(struct route_entry *e)
 }
 
 /*---------------------------------------------------------------------------*/
-//Not implemented and only maintained for compatibility.
+//Removes every route entry at once and returns all of them to route_set_mem.
 void
 route_flush_all(void)
 {
+	list_init(route_set);
+	memb_init(&route_set_mem);
+	memset(route_index, 0, sizeof(route_index));
+	num_routes = 0;
+	get_cursor = NULL;
 
+	PRINTF("route_flush_all: done\n");
 }
 /*---------------------------------------------------------------------------*/
-//Not implemented and only maintained for compatibility.
+//Sets the lifetime of non-refreshed routes. It applies to routes added or
+//refreshed from now on; routes that would outlive the new lifetime are cut
+//short to it. seconds is clamped to 0 .. TIME_HALF_RANGE / CLOCK_SECOND,
+//the longest lifetime the wrap-around time comparisons can tell apart.
 void
 route_set_lifetime(int seconds)
 {
+	struct route_entry *e;
+	clock_time_t deadline;
+
+	if(seconds < 0) {
+		seconds = 0;
+	} else if((unsigned long)seconds > TIME_HALF_RANGE / CLOCK_SECOND) {
+		seconds = TIME_HALF_RANGE / CLOCK_SECOND;
+	}
+	max_route_time = seconds;
+	deadline = clock_time() + (clock_time_t)max_route_time * CLOCK_SECOND;
+	for(e = list_head(route_set); e != NULL; e = list_item_next(e)) {
+		if(!TIME_REACHED(deadline, e->R_valid_time)) {
+			e->R_valid_time = deadline;
+		}
+	}
+	if(list_head(route_set) != NULL) {
+		schedule_expiry(deadline);
+	}
 
+	PRINTF("route_set_lifetime: %d seconds\n", seconds);
 }
 /*---------------------------------------------------------------------------*/
-//Not implemented and only maintained for compatibility.
+//Returns the number of entries in the Routing Set.
 int
 route_num(void)
 {
-	return -1;
+	return num_routes;
 }
 /*---------------------------------------------------------------------------*/
-//Not implemented and only maintained for compatibility.
+//Returns the num-th entry of the Routing Set, or NULL past its end.
+//Consecutive calls with increasing num continue from the previous entry.
 struct route_entry *
 route_get(int num)
 {
-	return NULL;
+	struct route_entry *e;
+	int i;
+
+	if(num < 0 || num >= num_routes) {
+		return NULL;
+	}
+
+	if(get_cursor != NULL && get_cursor_num <= num) {
+		e = get_cursor;
+		i = get_cursor_num;
+	} else {
+		e = list_head(route_set);
+		i = 0;
+	}
+	for(; e != NULL && i < num; i++) {
+		e = list_item_next(e);
+	}
+
+	get_cursor = e;
+	get_cursor_num = num;
+	return e;
 }
 /*---------------------------------------------------------------------------*/
 /** @} */
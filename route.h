@@ -58,7 +58,7 @@ struct pending_entry {
 	struct pending_entry* next;
 	rimeaddr_t P_next_hop;
 	rimeaddr_t P_originator;
-	clock_time_t P_ack_timeout;
+	clock_time_t P_ack_timeout;	//absolute time at which the RREP-ACK is given up on
 	uint16_t P_seq_num;
 };
 
@@ -66,15 +66,16 @@ struct pending_entry {
 struct blacklist_tuple {
 	struct blacklist_tuple* next;
 	rimeaddr_t B_neighbor_address;
-	clock_time_t B_valid_time;
+	clock_time_t B_valid_time;	//absolute time at which the tuple expires
 };
 
 //The distance structure consists of a tuple (route_cost, weak_links), and
 //works together with its correspondent metrics.
 struct dist_tuple {
-	uint8_t route_cost;
+	uint16_t route_cost;
 	uint8_t weak_links:4;
 	uint8_t padding:4;	//not used, initialized to 0;
+	uint8_t hops;	//number of hops, whatever the metric behind route_cost
 };
 
 //This structure redefines the routing tuple with another name.
@@ -87,31 +88,43 @@ struct route_entry {
 	rimeaddr_t R_next_addr;
 	struct dist_tuple R_dist;
 	uint16_t R_seq_num;
-	clock_time_t R_valid_time;
-	uint8_t R_metric:4;	//R_metric: type of routing metric. 0, by default, means using hop-count
-	uint8_t padding:4;	//not used, initialized to 0;
+	clock_time_t R_valid_time;	//absolute time at which the tuple expires
+	clock_time_t R_last_used;	//last time the route was refreshed or used for forwarding
+	uint8_t R_metric:4;	//R_metric: type of routing metric, see route-metric.h
+	uint8_t R_pinned:1;	//pinned routes are never evicted when the Routing Set is full
+	uint8_t R_rr_used:1;	//already picked in the current round of route_lookup_balanced()
+	uint8_t padding:2;	//not used, initialized to 0;
 };
 
 void route_init(void);
 struct routing_entry *route_add(const rimeaddr_t *dest,
 		const rimeaddr_t *nexthop, struct dist_tuple *dist, uint16_t seqno);
+void route_update(struct route_entry *e, const rimeaddr_t *nexthop,
+		struct dist_tuple *dist, uint16_t seqno);
 struct route_entry *route_lookup(const rimeaddr_t *dest);
+struct route_entry *route_lookup_balanced(const rimeaddr_t *dest);
+struct route_entry *route_lookup_via(const rimeaddr_t *dest, const rimeaddr_t *nexthop);
 struct pending_entry *route_pending_list_lookup (const rimeaddr_t *from,
 		const rimeaddr_t *orig, uint16_t seq_num);
+//timeout arguments are relative, in clock ticks
 struct pending_entry *route_pending_add(const rimeaddr_t *nexthop,
 		const rimeaddr_t *dest, uint16_t RREQ_ID, clock_time_t timeout);
 struct blacklist_tuple *route_blacklist_lookup(const rimeaddr_t *addr );
 struct blacklist_tuple *route_blacklist_add(const rimeaddr_t *neighbor, clock_time_t timeout );
 void route_refresh(struct route_entry *e);
+void route_use(struct route_entry *e);
+void route_pin(struct route_entry *e, int pinned);
 void route_decay(struct route_entry *e);
 void route_remove(struct route_entry *e);
 void pending_remove(struct pending_entry *e);
+void pending_expire(struct pending_entry *e);
 void blacklist_remove(struct blacklist_tuple *e);
 
 void route_flush_all(void);
 void route_set_lifetime(int seconds);
 int route_num(void);
 struct route_entry *route_get(int num);
+uint8_t route_last_hops(const rimeaddr_t *dest);
 
 #endif /* __ROUTE_H__ */
 /** @} */
@@ -57,6 +57,9 @@ PROCESS_THREAD(route_test, ev, data)
   PROCESS_BEGIN();
   rimeaddr_t addr[ADDR_NUM];
   struct dist_tuple dist;
+  struct route_entry *e;
+  int found[ADDR_NUM];
+  rimeaddr_t other;
   memset(&dist, 0, sizeof(dist));
   int i;
   //initialize address set
@@ -69,12 +72,92 @@ PROCESS_THREAD(route_test, ev, data)
   for (i = 0; i < ADD_NUM; i++) {
 	  dist.route_cost = i;
 	  dist.weak_links = 0;
+	  dist.hops = 1;
 	  printf("test: route_add dest = %d.%d\n", addr[i].u8[0], addr[i].u8[1]);
 	  route_add(&addr[i], &addr[i+1], &dist, i);
 	  printf("test: route_lookup dest = %d.%d\n", addr[i].u8[0], addr[i].u8[1]);
 	  route_lookup(&addr[i]);
   }
 
+  //fill the table beyond its capacity, the oldest entries get evicted
+  for (i = 0; i < ADDR_NUM; i++) {
+	  dist.route_cost = i;
+	  route_add(&addr[i], &addr[(i + 1) % ADDR_NUM], &dist, i);
+  }
+  //only the route_num() most recently added are left
+  for (i = 0; i < ADDR_NUM; i++) {
+	  e = route_lookup(&addr[i]);
+	  found[i] = (e != NULL && rimeaddr_cmp(&e->R_dest_addr, &addr[i]));
+	  printf("test: route_evict dest = %d.%d %s %s\n", addr[i].u8[0], addr[i].u8[1],
+			  found[i] ? "found" : "evicted",
+			  found[i] == (i >= ADDR_NUM - route_num()) ? "ok" : "FAILED");
+  }
+
+  //remove every other entry and check the rest is still reachable
+  for (i = 0; i < ADDR_NUM; i += 2) {
+	  route_remove(route_lookup(&addr[i]));
+  }
+  for (i = 1; i < ADDR_NUM; i += 2) {
+	  if (!found[i]) {
+		  continue;
+	  }
+	  e = route_lookup(&addr[i]);
+	  printf("test: route_remove check dest = %d.%d %s\n", addr[i].u8[0], addr[i].u8[1],
+			  e != NULL && rimeaddr_cmp(&e->R_dest_addr, &addr[i]) ? "ok" : "FAILED");
+  }
+
+  //a pinned route survives a table full of newer routes
+  route_pin(route_lookup(&addr[ADDR_NUM - 1]), 1);
+  for (i = 0; i < 2 * ADDR_NUM; i++) {
+	  other.u8[0] = 100 + i;
+	  other.u8[1] = 100 + i;
+	  route_add(&other, &addr[0], &dist, i);
+  }
+  e = route_lookup(&addr[ADDR_NUM - 1]);
+  printf("test: route_pin check dest = %d.%d %s\n",
+		  addr[ADDR_NUM - 1].u8[0], addr[ADDR_NUM - 1].u8[1],
+		  e != NULL ? "ok" : "FAILED");
+
+  //a removed route leaves its hop count behind
+  other.u8[0] = 200;
+  other.u8[1] = 200;
+  dist.route_cost = 3;
+  dist.hops = 3;
+  route_add(&other, &addr[0], &dist, 0);
+  route_remove(route_lookup(&other));
+  printf("test: route_last_hops dest = %d.%d %s\n", other.u8[0], other.u8[1],
+		  route_lookup(&other) == NULL && route_last_hops(&other) == 3 ? "ok" : "FAILED");
+
+  //fewer weak links beat a lower cost
+  other.u8[0] = 210;
+  other.u8[1] = 210;
+  dist.route_cost = 2;
+  dist.weak_links = 1;
+  route_add(&other, &addr[1], &dist, 0);
+  dist.route_cost = 5;
+  dist.weak_links = 0;
+  route_add(&other, &addr[2], &dist, 0);
+  e = route_lookup(&other);
+  printf("test: route_lookup weak links dest = %d.%d %s\n", other.u8[0], other.u8[1],
+		  e != NULL && rimeaddr_cmp(&e->R_next_addr, &addr[2]) ? "ok" : "FAILED");
+
+  //a blacklisted next hop is skipped in favour of the alternate
+  route_blacklist_add(&addr[2], 10 * CLOCK_SECOND);
+  e = route_lookup(&other);
+  printf("test: route_blacklist dest = %d.%d %s\n", other.u8[0], other.u8[1],
+		  e != NULL && rimeaddr_cmp(&e->R_next_addr, &addr[1]) ? "ok" : "FAILED");
+  blacklist_remove(route_blacklist_lookup(&addr[2]));
+
+  //walk the table with route_get and flush it
+  for (i = 0; (e = route_get(i)) != NULL; i++) {
+	  printf("test: route_get %d dest = %d.%d\n", i, e->R_dest_addr.u8[0], e->R_dest_addr.u8[1]);
+  }
+  printf("test: route_num %d %s\n", route_num(), route_num() == i ? "ok" : "FAILED");
+  route_flush_all();
+  printf("test: route_flush_all %s\n",
+		  route_num() == 0 && route_get(0) == NULL && route_lookup(&addr[ADDR_NUM - 1]) == NULL ?
+		  "ok" : "FAILED");
+
   PROCESS_END();
 }
 /*---------------------------------------------------------------------------*/
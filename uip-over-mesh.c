@@ -39,9 +39,13 @@
 
 #include <stdio.h>
 
+#include "lib/list.h"
+#include "lib/memb.h"
+
 #include "net/hc.h"
 #include "net/uip-fw.h"
 #include "net/uip-over-mesh.h"
+#include "net/rime/link-cost.h"
 #include "net/rime/route-discovery.h"
 #include "net/rime/route.h"
 #include "net/rime/trickle.h"
@@ -50,8 +54,32 @@
 #define ROUTE_DISCOVERY_INTERVAL CLOCK_SECOND * 4
 #define ROUTE_TIMEOUT CLOCK_SECOND * 4
 
-static struct queuebuf *queued_packet;
-static rimeaddr_t queued_receiver;
+/*
+ * IP packets waiting for a route to their receiver. The queue is bounded
+ * both in packets and in total bytes of IP data.
+ */
+#ifdef UIP_OVER_MESH_CONF_QUEUED_PACKETS
+#define NUM_QUEUED_PACKETS UIP_OVER_MESH_CONF_QUEUED_PACKETS
+#else /* UIP_OVER_MESH_CONF_QUEUED_PACKETS */
+#define NUM_QUEUED_PACKETS 4
+#endif /* UIP_OVER_MESH_CONF_QUEUED_PACKETS */
+#ifdef UIP_OVER_MESH_CONF_QUEUE_BYTES
+#define QUEUE_BYTES UIP_OVER_MESH_CONF_QUEUE_BYTES
+#else /* UIP_OVER_MESH_CONF_QUEUE_BYTES */
+#define QUEUE_BYTES 256
+#endif /* UIP_OVER_MESH_CONF_QUEUE_BYTES */
+
+struct queued_packet {
+  struct queued_packet *next;
+  struct queuebuf *buf;
+  rimeaddr_t receiver;
+  uint16_t len;
+  struct ctimer t;
+};
+
+LIST(queued_packets);
+MEMB(queued_packets_mem, struct queued_packet, NUM_QUEUED_PACKETS);
+static uint16_t queued_bytes;
 
  /* Connection for route discovery: */
 static struct route_discovery_conn route_discovery;
@@ -111,49 +139,176 @@ recv_data(struct unicast_conn *c, const rimeaddr_t *from)
 	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1], uip_len);
   tcpip_input();
 }
+/*---------------------------------------------------------------------------*/
+/*
+ * A data packet the next hop never acknowledged. The sent callback runs
+ * inside the MAC callback, so the route error is handled from a timer.
+ */
+#define NUM_LINK_FAILURES 2	//failures waiting to be handled at once
+
+struct link_failure {
+  struct link_failure *next;
+  rimeaddr_t source;
+  rimeaddr_t receiver;
+  rimeaddr_t nexthop;
+  struct ctimer t;
+};
+
+LIST(link_failures);
+MEMB(link_failures_mem, struct link_failure, NUM_LINK_FAILURES);
+
 /*---------------------------------------------------------------------------*/
 static void
-send_data(rimeaddr_t *next)
+send_data(rimeaddr_t *next, const rimeaddr_t *receiver)
 {
+  struct uip_tcpip_hdr *hdr = packetbuf_dataptr();
+
   PRINTF("uip-over-mesh: %d.%d: send_data with len %d\n",
 	 rimeaddr_node_addr.u8[0], rimeaddr_node_addr.u8[1],
 	 packetbuf_totlen());
+
+  /* The source and receiver travel with the packet, so that a failed
+     transmission can be reported to its source. Packets from outside the
+     network came in through the gateway. */
+  if(uip_ipaddr_maskcmp(&hdr->srcipaddr, &netaddr, &netmask)) {
+    rimeaddr_t source;
+
+    source.u8[0] = hdr->srcipaddr.u8[2];
+    source.u8[1] = hdr->srcipaddr.u8[3];
+    packetbuf_set_addr(PACKETBUF_ADDR_ESENDER, &source);
+  } else {
+    packetbuf_set_addr(PACKETBUF_ADDR_ESENDER, &gateway);
+  }
+  packetbuf_set_addr(PACKETBUF_ADDR_ERECEIVER, receiver);
   unicast_send(&dataconn, next);
 }
 /*---------------------------------------------------------------------------*/
 static void
+link_failure_handle(void *ptr)
+{
+  struct link_failure *f = ptr;
+
+  PRINTF("uip-over-mesh: %d.%d did not ack packet to %d.%d\n",
+	 f->nexthop.u8[0], f->nexthop.u8[1],
+	 f->receiver.u8[0], f->receiver.u8[1]);
+  route_remove(route_lookup_via(&f->receiver, &f->nexthop));
+  if(!rimeaddr_cmp(&f->source, &rimeaddr_node_addr)) {
+    route_discovery_rerr(&route_discovery, RERR_NO_AVAILABLE_LINK,
+			 &f->source, &f->receiver);
+  }
+  list_remove(link_failures, f);
+  memb_free(&link_failures_mem, f);
+}
+/*---------------------------------------------------------------------------*/
+static void
+sent_data(struct unicast_conn *c, int status, int num_tx)
+{
+  struct link_failure *f;
+
+  link_cost_sent(packetbuf_addr(PACKETBUF_ADDR_RECEIVER), status, num_tx);
+  if(status != MAC_TX_NOACK) {
+    return;
+  }
+  f = memb_alloc(&link_failures_mem);
+  if(f == NULL) {
+    return;
+  }
+  /* packetbuf still holds the packet that failed. */
+  rimeaddr_copy(&f->source, packetbuf_addr(PACKETBUF_ADDR_ESENDER));
+  rimeaddr_copy(&f->receiver, packetbuf_addr(PACKETBUF_ADDR_ERECEIVER));
+  rimeaddr_copy(&f->nexthop, packetbuf_addr(PACKETBUF_ADDR_RECEIVER));
+  list_add(link_failures, f);
+  ctimer_set(&f->t, 0, link_failure_handle, f);
+}
+/*---------------------------------------------------------------------------*/
+static void
+queued_packet_remove(struct queued_packet *q)
+{
+  ctimer_stop(&q->t);
+  list_remove(queued_packets, q);
+  queuebuf_free(q->buf);
+  queued_bytes -= q->len;
+  memb_free(&queued_packets_mem, q);
+}
+/*---------------------------------------------------------------------------*/
+static void
+queued_packet_timeout(void *ptr)
+{
+  PRINTF("uip-over-mesh: queued packet timed out\n");
+  queued_packet_remove(ptr);
+}
+/*---------------------------------------------------------------------------*/
+//Queues the packet in packetbuf until a route to receiver is found.
+//Returns 0 if the queue has no room for it.
+static int
+queued_packet_add(const rimeaddr_t *receiver)
+{
+  struct queued_packet *q;
+  uint16_t len = packetbuf_totlen();
+
+  if(queued_bytes + len > QUEUE_BYTES) {
+    return 0;
+  }
+  q = memb_alloc(&queued_packets_mem);
+  if(q == NULL) {
+    return 0;
+  }
+  q->buf = queuebuf_new_from_packetbuf();
+  if(q->buf == NULL) {
+    memb_free(&queued_packets_mem, q);
+    return 0;
+  }
+  rimeaddr_copy(&q->receiver, receiver);
+  q->len = len;
+  queued_bytes += len;
+  list_add(queued_packets, q);
+  ctimer_set(&q->t, ROUTE_TIMEOUT, queued_packet_timeout, q);
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static void
 new_route(struct route_discovery_conn *c, const rimeaddr_t *to)
 {
   struct route_entry *rt;
-  
-  if(queued_packet) {
+  struct queued_packet *q, *next;
+
+  /* Send the packets queued for this receiver, oldest first. */
+  for(q = list_head(queued_packets); q != NULL; q = next) {
+    next = list_item_next(q);
+    if(!rimeaddr_cmp(to, &q->receiver)) {
+      continue;
+    }
     PRINTF("uip-over-mesh: new route, sending queued packet\n");
-    
-    queuebuf_to_packetbuf(queued_packet);
-    queuebuf_free(queued_packet);
-    queued_packet = NULL;
 
-    rt = route_lookup(&queued_receiver);
+    queuebuf_to_packetbuf(q->buf);
+    queued_packet_remove(q);
+
+    rt = route_lookup_balanced(to);
     if(rt) {
       route_decay(rt);
-      send_data(&queued_receiver);
+      route_use(rt);
+      send_data(&rt->R_next_addr, to);
     }
   }
 }
 /*---------------------------------------------------------------------------*/
 static void
-timedout(struct route_discovery_conn *c)
+timedout(struct route_discovery_conn *c, const rimeaddr_t *to)
 {
+  struct queued_packet *q, *next;
+
   PRINTF("uip-over-mesh: packet timed out\n");
-  if(queued_packet) {
-    PRINTF("uip-over-mesh: freeing queued packet\n");
-    queuebuf_free(queued_packet);
-    queued_packet = NULL;
+  for(q = list_head(queued_packets); q != NULL; q = next) {
+    next = list_item_next(q);
+    if(rimeaddr_cmp(to, &q->receiver)) {
+      PRINTF("uip-over-mesh: freeing queued packet\n");
+      queued_packet_remove(q);
+    }
   }
 }
 /*---------------------------------------------------------------------------*/
-static const struct unicast_callbacks data_callbacks = { recv_data };
-static const struct route_discovery_callbacks rdc = { new_route, timedout };
+static const struct unicast_callbacks data_callbacks = { recv_data, sent_data };
+static const struct route_discovery_callbacks rdc = { new_route, NULL, timedout };
 /*---------------------------------------------------------------------------*/
 struct gateway_msg {
   rimeaddr_t gateway;
@@ -268,19 +423,29 @@ uip_over_mesh_send(void)
     /*    packetbuf_set_attr(PACKETBUF_ATTR_PACKET_TYPE, PACKETBUF_ATTR_PACKET_TYPE_STREAM);*/
   }
 
-  rt = route_lookup(&receiver);
+  rt = route_lookup_balanced(&receiver);
   if(rt == NULL) {
     PRINTF("uIP over mesh no route to %d.%d\n", receiver.u8[0], receiver.u8[1]);
-    if(queued_packet == NULL) {
-      queued_packet = queuebuf_new_from_packetbuf();
-      rimeaddr_copy(&queued_receiver, &receiver);
-      route_discovery_discover(&route_discovery, &receiver, ROUTE_TIMEOUT);
-    } else if(!rimeaddr_cmp(&queued_receiver, &receiver)) {
-      route_discovery_discover(&route_discovery, &receiver, ROUTE_TIMEOUT);
+    if(route_discovery_unreachable(&receiver)) {
+      PRINTF("uip_over_mesh_send: %d.%d unreachable, dropping packet\n",
+	     receiver.u8[0], receiver.u8[1]);
+      return UIP_FW_DROPPED;
+    }
+    if(!queued_packet_add(&receiver)) {
+      PRINTF("uip_over_mesh_send: queue full, dropping packet\n");
+      return UIP_FW_DROPPED;
+    }
+    if(!route_discovery_discover(&route_discovery, &receiver, ROUTE_TIMEOUT)) {
+      /* No discovery will answer for it, do not let it wait in vain. */
+      PRINTF("uip_over_mesh_send: no discovery of %d.%d, dropping packet\n",
+	     receiver.u8[0], receiver.u8[1]);
+      queued_packet_remove(list_tail(queued_packets));
+      return UIP_FW_DROPPED;
     }
   } else {
     route_decay(rt);
-    send_data(&rt->R_next_addr);
+    route_use(rt);
+    send_data(&rt->R_next_addr, &receiver);
   }
   return UIP_FW_OK;
 }